@@ -0,0 +1,40 @@
+#include "common.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+// Per thread, so multi-threaded benchmarks don't contend on the counter.
+thread_local std::size_t allocations = 0;
+
+} // namespace
+
+namespace bench {
+
+std::size_t allocationCount()
+{
+    return allocations;
+}
+
+} // namespace bench
+
+void* operator new(std::size_t size)
+{
+    ++allocations;
+
+    if (void* p = std::malloc(size != 0 ? size : 1))
+        return p;
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "di.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstddef>
+#include <utility>
+
+namespace bench {
+
+/// Number of heap allocations made by the calling thread so far.
+std::size_t allocationCount();
+
+/// Reports the heap allocations per iteration made by the calling thread during its lifetime
+/// as counter "allocs/op". Create it right before the benchmark loop.
+class AllocationCounter
+{
+public:
+    explicit AllocationCounter(benchmark::State& state) :
+        state_{state},
+        start_{allocationCount()}
+    {}
+
+    AllocationCounter(const AllocationCounter&) = delete;
+    AllocationCounter& operator=(const AllocationCounter&) = delete;
+
+    ~AllocationCounter()
+    {
+        auto n = static_cast<double>(allocationCount() - start_);
+        state_.counters["allocs/op"] = benchmark::Counter(n, benchmark::Counter::kAvgIterations);
+    }
+
+private:
+    benchmark::State& state_;
+    std::size_t start_;
+};
+
+
+struct Printer { virtual ~Printer() = default; };
+struct PrinterImpl : Printer {};
+
+// Padding services, so bindings can have realistic sizes.
+template <int N> struct Filler { virtual ~Filler() = default; };
+template <int N> struct FillerImpl : Filler<N> {};
+
+/// Binds Filler<0> ... Filler<N-1>.
+template <int ... Ns>
+void bindFillers(di::Bindings& bindings, std::integer_sequence<int, Ns ...>)
+{
+    (bindings.service<Filler<Ns>, FillerImpl<Ns>>(), ...);
+}
+
+template <int N>
+di::Bindings makeBindings()
+{
+    auto bindings = di::Bindings{};
+    bindFillers(bindings, std::make_integer_sequence<int, N>{});
+    bindings.service<Printer, PrinterImpl>();
+    return bindings;
+}
+
+} // namespace bench
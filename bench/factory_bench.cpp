@@ -0,0 +1,115 @@
+#include "common.h"
+
+#include "di.h"
+
+#include <benchmark/benchmark.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <tuple>
+
+using bench::AllocationCounter;
+using bench::Printer;
+
+namespace {
+
+
+struct FilePrinterImpl : Printer
+{
+    FilePrinterImpl(std::string fn, int mode, double level) :
+        fn{std::move(fn)}, mode{mode}, level{level}
+    {}
+
+    std::string fn;
+    int mode;
+    double level;
+};
+
+const std::string fileName = "some/long/path/to/the/log/file.txt";
+
+// Reference: the std::function factory ImplData used before.
+std::function<std::shared_ptr<void>()> makeFunctionFactory()
+{
+    return [storedArgs = std::make_tuple(fileName, 1, 0.5)] () -> std::shared_ptr<void> {
+        return std::apply([](const auto& ... args){
+            return std::make_shared<FilePrinterImpl>(args ...);
+        }, storedArgs);
+    };
+}
+
+const di::detail::ImplData& makeImplData()
+{
+    static const auto bindings = di::Bindings{}.service<Printer, FilePrinterImpl>(fileName, 1, 0.5);
+    const auto& table = di::detail::BindingsState::fromBindings(bindings).table();
+    return *table->find(di::detail::interfaceId<Printer>());
+}
+
+} // namespace
+
+
+static void BM_BindFunction(benchmark::State& state)
+{
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+        benchmark::DoNotOptimize(makeFunctionFactory());
+}
+BENCHMARK(BM_BindFunction);
+
+static void BM_BindImplData(benchmark::State& state)
+{
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        auto bindings = di::Bindings{}.service<Printer, FilePrinterImpl>(fileName, 1, 0.5);
+        benchmark::DoNotOptimize(bindings);
+    }
+}
+BENCHMARK(BM_BindImplData);
+
+static void BM_CopyFunction(benchmark::State& state)
+{
+    auto factory = makeFunctionFactory();
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        auto copy = factory;
+        benchmark::DoNotOptimize(copy);
+    }
+}
+BENCHMARK(BM_CopyFunction);
+
+static void BM_CopyImplData(benchmark::State& state)
+{
+    const auto& impl = makeImplData();
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        auto copy = impl;
+        benchmark::DoNotOptimize(copy);
+    }
+}
+BENCHMARK(BM_CopyImplData);
+
+static void BM_InvokeFunction(benchmark::State& state)
+{
+    auto factory = makeFunctionFactory();
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+        benchmark::DoNotOptimize(factory());
+}
+BENCHMARK(BM_InvokeFunction);
+
+static void BM_InvokeImplData(benchmark::State& state)
+{
+    const auto& impl = makeImplData();
+    di::detail::ScopeState scope{nullptr, {}};
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+        benchmark::DoNotOptimize(impl.create(scope));
+}
+BENCHMARK(BM_InvokeImplData);
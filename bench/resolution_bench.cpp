@@ -0,0 +1,301 @@
+#include "common.h"
+
+#include "di.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
+
+using namespace bench;
+
+namespace {
+
+struct Counter
+{
+    virtual ~Counter() = default;
+    virtual void add() = 0;
+};
+
+struct CounterImpl : Counter
+{
+    void add() override { n.fetch_add(1, std::memory_order_relaxed); }
+
+    std::atomic<long> n{0};
+};
+
+const di::Bindings& bindings()
+{
+    static const di::Bindings b = makeBindings<32>().service<Counter, CounterImpl>();
+    return b;
+}
+
+// Process root scope, which benchmark threads without scopes of their own resolve from.
+const di::Scope rootScope{bindings()};
+
+} // namespace
+
+
+// Reference: the type_index hash map lookup ScopeState used before dense ids.
+static void BM_TypeIndexMapLookup(benchmark::State& state)
+{
+    std::unordered_map<std::type_index, std::shared_ptr<void>> instances;
+    instances.emplace(typeid(Printer), std::make_shared<PrinterImpl>());
+
+    for (auto _ : state)
+    {
+        auto e = instances.find(std::type_index{typeid(Printer)});
+        benchmark::DoNotOptimize(e->second.get());
+    }
+}
+BENCHMARK(BM_TypeIndexMapLookup);
+
+// Reference: the dense-id table lookup ScopeState uses now.
+static void BM_DenseIdLookup(benchmark::State& state)
+{
+    std::vector<std::shared_ptr<void>> instances(64);
+    auto id = di::detail::interfaceId<Printer>();
+    instances.resize(std::max(instances.size(), id + 1));
+    instances[id] = std::make_shared<PrinterImpl>();
+
+    for (auto _ : state)
+    {
+        auto i = di::detail::interfaceId<Printer>();
+        benchmark::DoNotOptimize(i < instances.size() ? instances[i].get() : nullptr);
+    }
+}
+BENCHMARK(BM_DenseIdLookup);
+
+static void BM_SharedRefHit(benchmark::State& state)
+{
+    auto scope = di::Scope{bindings()};
+    di::ServiceRef<Printer> warm;
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        di::ServiceRef<Printer> ref;
+        benchmark::DoNotOptimize(&*ref);
+    }
+}
+BENCHMARK(BM_SharedRefHit);
+
+static void BM_SharedRefHitStatic(benchmark::State& state)
+{
+    auto scope = di::Scope{di::StaticBindings<di::Bind<Printer, PrinterImpl>>{}};
+    di::ServiceRef<Printer> warm;
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        di::ServiceRef<Printer> ref;
+        benchmark::DoNotOptimize(&*ref);
+    }
+}
+BENCHMARK(BM_SharedRefHitStatic);
+
+static void BM_BorrowedRefHit(benchmark::State& state)
+{
+    auto scope = di::Scope{bindings()};
+    di::ServiceRef<Printer> warm;
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        di::BorrowedServiceRef<Printer> ref;
+        benchmark::DoNotOptimize(&*ref);
+    }
+}
+BENCHMARK(BM_BorrowedRefHit);
+
+// Creating a LazyServiceRef that is never dereferenced.
+static void BM_LazyRefUnused(benchmark::State& state)
+{
+    auto scope = di::Scope{bindings()};
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        di::LazyServiceRef<Printer> ref;
+        benchmark::DoNotOptimize(&ref);
+    }
+}
+BENCHMARK(BM_LazyRefUnused);
+
+// Dereferencing a LazyServiceRef once it is resolved.
+static void BM_LazyRefDeref(benchmark::State& state)
+{
+    auto scope = di::Scope{bindings()};
+    di::LazyServiceRef<Printer> ref;
+    benchmark::DoNotOptimize(ref.operator->());
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(ref.operator->());
+}
+BENCHMARK(BM_LazyRefDeref);
+
+static void BM_ExclusiveRef(benchmark::State& state)
+{
+    auto scope = di::Scope{bindings()};
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        di::ServiceRef<Printer, di::tags::Exclusive> ref;
+        benchmark::DoNotOptimize(&*ref);
+    }
+}
+BENCHMARK(BM_ExclusiveRef);
+
+static void BM_PooledRef(benchmark::State& state)
+{
+    auto scope = di::Scope{bindings()};
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        di::ServiceRef<Printer, di::tags::Pooled> ref;
+        benchmark::DoNotOptimize(&*ref);
+    }
+}
+BENCHMARK(BM_PooledRef);
+
+// First resolution of a shared instance, i.e. its construction. Includes creating the scope.
+static void BM_FirstConstruction(benchmark::State& state)
+{
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        auto scope = di::Scope{bindings()};
+        di::ServiceRef<Printer> ref;
+        benchmark::DoNotOptimize(&*ref);
+    }
+}
+BENCHMARK(BM_FirstConstruction);
+
+// Per-request scope that constructs a few shared services, with and without arena.
+static void BM_RequestScope(benchmark::State& state)
+{
+    auto options = di::ScopeOptions{};
+    options.arenaBlockSize = static_cast<std::size_t>(state.range(0));
+
+    di::ArenaStats stats;
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        auto scope = di::Scope{options, bindings()};
+        di::ServiceRef<Printer> printer;
+        di::ServiceRef<Filler<0>> filler0;
+        di::ServiceRef<Filler<1>> filler1;
+        benchmark::DoNotOptimize(&*printer);
+
+        stats = scope.arenaStats();
+    }
+
+    state.counters["arena_allocs"] = static_cast<double>(stats.allocations);
+    state.counters["arena_bytes"] = static_cast<double>(stats.bytes);
+}
+BENCHMARK(BM_RequestScope)->Arg(0)->Arg(1024);
+
+// Threads resolve from the root scope concurrently.
+static void BM_SharedRefHitThreaded(benchmark::State& state)
+{
+    di::ServiceRef<Printer> warm;
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        di::ServiceRef<Printer> ref;
+        benchmark::DoNotOptimize(&*ref);
+    }
+}
+BENCHMARK(BM_SharedRefHitThreaded)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_PerThreadRefHitThreaded(benchmark::State& state)
+{
+    di::ServiceRef<Printer, di::tags::PerThread> warm;
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        di::ServiceRef<Printer, di::tags::PerThread> ref;
+        benchmark::DoNotOptimize(&*ref);
+    }
+}
+BENCHMARK(BM_PerThreadRefHitThreaded)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_BorrowedPerThreadRefHitThreaded(benchmark::State& state)
+{
+    di::ServiceRef<Printer, di::tags::PerThread> warm;
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        di::BorrowedServiceRef<Printer, di::tags::PerThread> ref;
+        benchmark::DoNotOptimize(&*ref);
+    }
+}
+BENCHMARK(BM_BorrowedPerThreadRefHitThreaded)->ThreadRange(1, 64)->UseRealTime();
+
+// A counter shared by all threads, as reference for the sharded one.
+static void BM_SharedCounterThreaded(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        di::BorrowedServiceRef<Counter> counter;
+        counter->add();
+    }
+}
+BENCHMARK(BM_SharedCounterThreaded)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_PerCpuCounterThreaded(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        di::BorrowedServiceRef<Counter, di::tags::PerCpu> counter;
+        counter->add();
+    }
+}
+BENCHMARK(BM_PerCpuCounterThreaded)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_BorrowedRefHitThreaded(benchmark::State& state)
+{
+    di::BorrowedServiceRef<Printer> warm;
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        di::BorrowedServiceRef<Printer> ref;
+        benchmark::DoNotOptimize(&*ref);
+    }
+}
+BENCHMARK(BM_BorrowedRefHitThreaded)->ThreadRange(1, 64)->UseRealTime();
+
+static void BM_ExclusiveRefThreaded(benchmark::State& state)
+{
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        di::ServiceRef<Printer, di::tags::Exclusive> ref;
+        benchmark::DoNotOptimize(&*ref);
+    }
+}
+BENCHMARK(BM_ExclusiveRefThreaded)->ThreadRange(1, 64)->UseRealTime();
+
+// Each thread opens its own request scopes concurrently.
+static void BM_RequestScopeThreaded(benchmark::State& state)
+{
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        auto scope = di::Scope{bindings()};
+        di::ServiceRef<Printer> ref;
+        benchmark::DoNotOptimize(&*ref);
+    }
+}
+BENCHMARK(BM_RequestScopeThreaded)->ThreadRange(1, 64)->UseRealTime();
@@ -0,0 +1,101 @@
+#include "common.h"
+
+#include "di.h"
+
+#include <benchmark/benchmark.h>
+
+using namespace bench;
+
+namespace {
+
+template <int N>
+const di::Bindings& bindings()
+{
+    static const di::Bindings b = makeBindings<N>();
+    return b;
+}
+
+} // namespace
+
+
+template <int N>
+static void BM_ScopeCreation(benchmark::State& state)
+{
+    const auto& b = bindings<N>();
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        auto scope = di::Scope{b};
+        benchmark::DoNotOptimize(&scope);
+    }
+}
+BENCHMARK_TEMPLATE(BM_ScopeCreation, 10);
+BENCHMARK_TEMPLATE(BM_ScopeCreation, 100);
+BENCHMARK_TEMPLATE(BM_ScopeCreation, 1000);
+
+// Scope over two overlapping bindings, which need to be merged.
+template <int N>
+static void BM_ScopeCreationMerged(benchmark::State& state)
+{
+    const auto& b = bindings<N>();
+    const auto& overrides = bindings<10>();
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        auto scope = di::Scope{b, overrides};
+        benchmark::DoNotOptimize(&scope);
+    }
+}
+BENCHMARK_TEMPLATE(BM_ScopeCreationMerged, 10);
+BENCHMARK_TEMPLATE(BM_ScopeCreationMerged, 100);
+BENCHMARK_TEMPLATE(BM_ScopeCreationMerged, 1000);
+
+// Request-style scope that resolves one shared service, created anew or recycled from a ScopePool.
+template <int N>
+static void BM_ScopeRequest(benchmark::State& state)
+{
+    const auto& b = bindings<N>();
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        auto scope = di::Scope{di::ScopeOptions{1024}, b};
+        di::BorrowedServiceRef<Printer> printer;
+        benchmark::DoNotOptimize(&*printer);
+    }
+}
+BENCHMARK_TEMPLATE(BM_ScopeRequest, 10);
+BENCHMARK_TEMPLATE(BM_ScopeRequest, 1000);
+
+template <int N>
+static void BM_ScopeRequestPooled(benchmark::State& state)
+{
+    auto pool = di::ScopePool{di::ScopeOptions{1024}, bindings<N>()};
+
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        auto scope = pool.acquire();
+        di::BorrowedServiceRef<Printer> printer;
+        benchmark::DoNotOptimize(&*printer);
+    }
+}
+BENCHMARK_TEMPLATE(BM_ScopeRequestPooled, 10);
+BENCHMARK_TEMPLATE(BM_ScopeRequestPooled, 1000);
+
+// Building Bindings with N + 1 services through Bindings::service.
+template <int N>
+static void BM_BindingsService(benchmark::State& state)
+{
+    AllocationCounter allocs{state};
+    for (auto _ : state)
+    {
+        auto b = makeBindings<N>();
+        benchmark::DoNotOptimize(&b);
+    }
+}
+BENCHMARK_TEMPLATE(BM_BindingsService, 10);
+BENCHMARK_TEMPLATE(BM_BindingsService, 100);
+BENCHMARK_TEMPLATE(BM_BindingsService, 1000);
@@ -1,7 +1,230 @@
 #include "di.h"
 
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+#if __has_include(<cxxabi.h>)
+#include <cxxabi.h>
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
 namespace di::detail {
 
+/// Per-thread bookkeeping for instance construction.
+struct ThreadContext
+{
+    struct Construction
+    {
+        const void* key;
+        const std::type_info* type;
+    };
+
+    static ThreadContext& current()
+    {
+        thread_local ThreadContext context;
+        return context;
+    }
+
+    void push(Construction c)
+    {
+        if (depth < inlineConstructions.size())
+            inlineConstructions[depth] = c;
+        else
+            overflowConstructions.push_back(c);
+
+        ++depth;
+    }
+
+    void pop()
+    {
+        --depth;
+
+        if (depth >= inlineConstructions.size())
+            overflowConstructions.pop_back();
+    }
+
+    const Construction& at(std::size_t i) const
+    {
+        return i < inlineConstructions.size() ? inlineConstructions[i] : overflowConstructions[i - inlineConstructions.size()];
+    }
+
+    // Services under construction on this thread, outermost first.
+    // Nesting is shallow in practice, so it rarely spills to the heap.
+    std::array<Construction, 16> inlineConstructions;
+    std::vector<Construction> overflowConstructions;
+    std::size_t depth = 0;
+
+    // Slot this thread is blocked on. Guarded by waitMtx.
+    const InstanceSlot* waitingFor = nullptr;
+
+    // Assigned round-robin, to spread threads over sharded structures.
+    std::size_t index = nextIndex.fetch_add(1, std::memory_order_relaxed);
+
+    static inline std::atomic<std::size_t> nextIndex{0};
+};
+
+namespace {
+
+std::string typeName(const std::type_info& type)
+{
+#if __has_include(<cxxabi.h>)
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+    if (status == 0 && demangled != nullptr)
+    {
+        std::string name = demangled;
+        std::free(demangled);
+        return name;
+    }
+#endif
+    return type.name();
+}
+
+// Describes the cycle closed by requesting key again, e.g. "circular dependency: A -> B -> A".
+std::string cycleMessage(const ThreadContext& context, const void* key, const std::type_info& type)
+{
+    std::string msg = "circular dependency: ";
+
+    std::size_t first = context.depth;
+    for (std::size_t i = 0; i < context.depth; ++i)
+    {
+        if (context.at(i).key == key)
+        {
+            first = i;
+            break;
+        }
+    }
+
+    // The cycle continues on another thread; only this thread's part of it is known.
+    bool local = first < context.depth;
+    if (!local)
+        first = 0;
+
+    for (std::size_t i = first; i < context.depth; ++i)
+        msg += typeName(*context.at(i).type) + " -> ";
+
+    msg += typeName(type);
+
+    if (!local)
+        msg += " (under construction on another thread)";
+
+    return msg;
+}
+
+// Waiting is the slow path of first construction only, so a single process-wide mutex suffices.
+// It also makes the waits-for relation between threads consistent across scopes.
+std::mutex waitMtx;
+std::condition_variable waitCv;
+
+// Follows owner -> waitingFor links, starting at the slot the given thread wants to wait for.
+bool wouldDeadlock(const InstanceSlot& slot, const ThreadContext& self)
+{
+    for (const InstanceSlot* s = &slot; s != nullptr; )
+    {
+        const ThreadContext* owner = s->owner.load();
+        if (owner == nullptr)
+            return false;
+
+        if (owner == &self)
+            return true;
+
+        s = owner->waitingFor;
+    }
+
+    return false;
+}
+
+} // namespace
+
+ConstructionGuard::ConstructionGuard(const void* key, const std::type_info& type)
+{
+    auto& context = ThreadContext::current();
+
+    for (std::size_t i = 0; i < context.depth; ++i)
+        if (context.at(i).key == key)
+            throw std::runtime_error(cycleMessage(context, key, type));
+
+    context.push({key, &type});
+}
+
+ConstructionGuard::~ConstructionGuard()
+{
+    ThreadContext::current().pop();
+}
+
+bool InstanceSlot::tryClaim()
+{
+    ThreadContext* expected = nullptr;
+    if (!owner.compare_exchange_strong(expected, &ThreadContext::current()))
+        return false;
+
+    // The previous owner may have published just before releasing its claim.
+    if (ready.load())
+    {
+        owner.store(nullptr);
+        return false;
+    }
+
+    return true;
+}
+
+void InstanceSlot::waitWhileClaimed(const std::type_info& type)
+{
+    auto& self = ThreadContext::current();
+
+    std::unique_lock lock(waitMtx);
+    hasWaiters.store(true);
+
+    if (ready.load() || owner.load() == nullptr)
+        return;
+
+    if (wouldDeadlock(*this, self))
+        throw std::runtime_error(cycleMessage(self, this, type));
+
+    self.waitingFor = this;
+    waitCv.wait(lock);
+    self.waitingFor = nullptr;
+}
+
+void InstanceSlot::publish(std::shared_ptr<void> value)
+{
+    instance = std::move(value);
+    ready.store(true);
+    owner.store(nullptr);
+
+    if (hasWaiters.load())
+    {
+        std::scoped_lock lock(waitMtx);
+        waitCv.notify_all();
+    }
+}
+
+std::shared_ptr<void> InstanceSlot::take()
+{
+    ready.store(false);
+    dependencies.clear();
+    return std::move(instance);
+}
+
+void InstanceSlot::abandon()
+{
+    owner.store(nullptr);
+
+    if (hasWaiters.load())
+    {
+        std::scoped_lock lock(waitMtx);
+        waitCv.notify_all();
+    }
+}
+
 const BindingsState& BindingsState::fromBindings(const Bindings& bindings)
 {
     return bindings.state_;
@@ -22,52 +245,1182 @@ ScopeState& ScopeState::fromScope(Scope& scope)
     return scope.state_;
 }
 
-void BindingsState::registerAtScope(ScopeState& scope) const
+void BindingsState::addImpl(TypeId interfaceType, ImplData impl)
+{
+    // Binding the same implementation twice is most likely a mistake, and would make binding order ambiguous.
+    if (table_ && interfaceType < table_->impls.size())
+    {
+        for (const auto& e : table_->impls[interfaceType])
+            if (e.implType == impl.implType)
+                throw std::runtime_error("duplicate binding: implementation is already bound to " + typeName(*impl.interfaceType));
+    }
+
+    if (!table_)
+        table_ = std::make_shared<BindingTable>();
+    else if (table_.use_count() > 1)
+        table_ = std::make_shared<BindingTable>(*table_);
+
+    auto& impls = table_->impls;
+    if (interfaceType >= impls.size())
+        impls.resize(std::max(interfaceType + 1, TypeIds<InterfaceDomain>::count()));
+
+    impls[interfaceType].push_back(std::move(impl));
+}
+
+std::size_t currentCpu()
+{
+#if defined(__linux__)
+    int cpu = sched_getcpu();
+    if (cpu >= 0)
+        return static_cast<std::size_t>(cpu);
+#endif
+    return ThreadContext::current().index;
+}
+
+std::size_t cpuCount()
+{
+    static const std::size_t count = std::max(std::thread::hardware_concurrency(), 1u);
+    return count;
+}
+
+ShardSet::ShardSet(const ImplData& impl, ScopeState& owner, std::size_t count)
+{
+    shards_.reserve(count);
+
+    for (std::size_t i = 0; i < count; ++i)
+        shards_.push_back(impl.createIsolated(owner));
+}
+
+namespace {
+
+constexpr std::size_t poolShardCount = 8;
+
+} // namespace
+
+struct alignas(64) ObjectPool::Shard
+{
+    std::mutex mtx;
+    std::vector<PooledObject> idle;
+    std::vector<void*> blocks;
+};
+
+ObjectPool::ObjectPool(const ImplData& impl, ScopeState& owner, const std::type_info& type) :
+    ops_{impl.poolOps},
+    args_{impl.args},
+    owner_{&owner},
+    type_{&type},
+    shardCapacity_{(impl.poolOps->capacity + poolShardCount - 1) / poolShardCount},
+    shards_{std::make_unique<Shard[]>(poolShardCount)}
+{
+    for (std::size_t i = 0; i < poolShardCount; ++i)
+    {
+        shards_[i].idle.reserve(shardCapacity_);
+        shards_[i].blocks.reserve(shardCapacity_);
+    }
+}
+
+ObjectPool::~ObjectPool()
+{
+    for (std::size_t i = 0; i < poolShardCount; ++i)
+    {
+        for (auto& obj : shards_[i].idle)
+            ops_->destroy(obj.instance);
+
+        for (void* block : shards_[i].blocks)
+            ::operator delete(block);
+    }
+}
+
+ObjectPool::Shard& ObjectPool::localShard()
+{
+    return shards_[ThreadContext::current().index % poolShardCount];
+}
+
+PooledObject ObjectPool::take()
+{
+    {
+        auto& shard = localShard();
+        std::scoped_lock lock(shard.mtx);
+
+        if (!shard.idle.empty())
+        {
+            PooledObject obj = shard.idle.back();
+            shard.idle.pop_back();
+            return obj;
+        }
+    }
+
+    auto activation = ScopeActivation(*owner_);
+    auto guard = ConstructionGuard(this, *type_);
+    return ops_->create(args_.get(), *owner_);
+}
+
+void ObjectPool::recycle(PooledObject obj)
+{
+    ops_->reset(obj.instance);
+
+    {
+        auto& shard = localShard();
+        std::scoped_lock lock(shard.mtx);
+
+        if (shard.idle.size() < shardCapacity_)
+        {
+            shard.idle.push_back(obj);
+            return;
+        }
+    }
+
+    ops_->destroy(obj.instance);
+}
+
+void* ObjectPool::allocateBlock(std::size_t size)
+{
+    // All control blocks of a pool have the same type, hence size. Only that size is recycled.
+    std::size_t expected = blockSize_.load(std::memory_order_relaxed);
+    if (expected == size || (expected == 0 && blockSize_.compare_exchange_strong(expected, size)))
+    {
+        auto& shard = localShard();
+        std::scoped_lock lock(shard.mtx);
+
+        if (!shard.blocks.empty())
+        {
+            void* block = shard.blocks.back();
+            shard.blocks.pop_back();
+            return block;
+        }
+    }
+
+    return ::operator new(size);
+}
+
+void ObjectPool::deallocateBlock(void* p, std::size_t size)
+{
+    if (size == blockSize_.load())
+    {
+        auto& shard = localShard();
+        std::scoped_lock lock(shard.mtx);
+
+        if (shard.blocks.size() < shardCapacity_)
+        {
+            shard.blocks.push_back(p);
+            return;
+        }
+    }
+
+    ::operator delete(p);
+}
+
+ScopeArena::ScopeArena(std::size_t blockSize) :
+    blockSize_{blockSize}
 {
-    for (const auto& [interfaceType, implMap] : interfaceMap_)
-        for (const auto& [implType, implData] : implMap)
-            scope.setServiceImpl(interfaceType, implData);
+    resource_.emplace(blockSize_);
+}
+
+void* ScopeArena::allocate(std::size_t bytes, std::size_t alignment)
+{
+    std::scoped_lock lock(mtx_);
+
+    void* p = resource_->allocate(bytes, alignment);
+    stats_.allocations += 1;
+    stats_.bytes += bytes;
+    return p;
+}
+
+ArenaStats ScopeArena::stats() const
+{
+    std::scoped_lock lock(mtx_);
+    return stats_;
+}
+
+void ScopeArena::reset()
+{
+    // Bounds the padding of allocations that are at most max-aligned.
+    std::size_t used = stats_.bytes + stats_.allocations * alignof(std::max_align_t);
+
+    resource_.reset();
+
+    if (used > bufferSize_)
+    {
+        bufferSize_ = std::max(used, blockSize_);
+        buffer_ = std::make_unique<std::byte[]>(bufferSize_);
+    }
+
+    if (buffer_)
+        resource_.emplace(buffer_.get(), bufferSize_);
+    else
+        resource_.emplace(blockSize_);
+
+    stats_ = {};
+}
+
+ScopeState::ScopeState(ScopeState* parent, std::initializer_list<const BindingsState*> bindings, const ScopeOptions& options) :
+    ScopeState(parent, mergeBindings(bindings), options)
+{}
+
+ScopeState::ScopeState(ScopeState* parent, std::shared_ptr<const BindingTable> bindings, const ScopeOptions& options) :
+    bindings_{std::move(bindings)},
+    parent_{parent}
+{
+    if (options.arenaBlockSize > 0)
+        arena_.emplace(options.arenaBlockSize);
+}
+
+std::shared_ptr<const BindingTable> ScopeState::mergeBindings(std::initializer_list<const BindingsState*> bindings)
+{
+    if (bindings.size() == 0)
+        return nullptr;
+
+    // Common case: share the table as is.
+    if (bindings.size() == 1)
+        return (*bindings.begin())->table();
+
+    auto merged = std::make_shared<BindingTable>();
+
+    for (const BindingsState* b : bindings)
+    {
+        if (!b->table())
+            continue;
+
+        const auto& impls = b->table()->impls;
+        if (merged->impls.size() < impls.size())
+            merged->impls.resize(impls.size());
+
+        for (std::size_t i = 0; i < impls.size(); ++i)
+            if (!impls[i].empty())
+                merged->impls[i] = impls[i];
+    }
+
+    return merged;
+}
+
+namespace {
+
+// Per-thread blocks of the calling thread. Their instances are destroyed when the thread ends.
+struct ThreadBlocks
+{
+    ~ThreadBlocks()
+    {
+        for (auto& block : blocks)
+            block->release();
+    }
+
+    std::vector<std::shared_ptr<PerThreadBlock>> blocks;
+};
+
+ThreadBlocks& threadBlocks()
+{
+    thread_local ThreadBlocks blocks;
+    return blocks;
+}
+
+std::atomic<std::uint64_t> nextScopeId{1};
+
+} // namespace
+
+void PerThreadBlock::release()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    if (alive)
+    {
+        alive = false;
+        instances.clear();
+    }
+}
+
+bool PerThreadBlock::isAlive()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return alive;
+}
+
+std::uint64_t ScopeState::id()
+{
+    if (std::uint64_t id = id_.load(std::memory_order_acquire))
+        return id;
+
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    std::uint64_t id = id_.load(std::memory_order_relaxed);
+    if (id == 0)
+    {
+        id = nextScopeId.fetch_add(1, std::memory_order_relaxed);
+        id_.store(id, std::memory_order_release);
+    }
+
+    return id;
+}
+
+PerThreadBlock& ScopeState::perThreadBlock()
+{
+    auto& blocks = threadBlocks().blocks;
+    std::uint64_t id = this->id();
+
+    auto it = std::find_if(blocks.begin(), blocks.end(), [id](const auto& block) { return block->scopeId == id; });
+
+    if (it == blocks.end())
+    {
+        // Blocks of destroyed scopes are dropped on this occasion, and vice versa.
+        blocks.erase(std::remove_if(blocks.begin(), blocks.end(), [](const auto& block) { return !block->isAlive(); }), blocks.end());
+
+        auto block = std::make_shared<PerThreadBlock>(id);
+
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+
+            perThreadBlocks_.erase(std::remove_if(perThreadBlocks_.begin(), perThreadBlocks_.end(),
+                [](const auto& b) { return !b->isAlive(); }), perThreadBlocks_.end());
+            perThreadBlocks_.push_back(block);
+        }
+
+        it = blocks.insert(blocks.end(), std::move(block));
+    }
+
+    lastPerThreadBlock_ = {id, it->get()};
+    return **it;
+}
+
+ScopeState::~ScopeState()
+{
+    // Invalidates captured contexts that outlive this scope, as far as they can tell.
+    id_.store(0, std::memory_order_relaxed);
+
+    // Instances may borrow from each other, so release them before checking for borrowed refs.
+    releaseInstances();
+    serviceInstances_.clear();
+
+#if DI_CHECK_BORROWED_REFS
+    if (auto n = borrowedRefs_.load(); n > 0)
+    {
+        std::fprintf(stderr, "di: scope destroyed while %zu BorrowedServiceRef(s) to its instances are alive\n", n);
+        std::abort();
+    }
+#endif
+}
+
+void ScopeState::reset()
+{
+    // Like destruction, this invalidates captured contexts and per-thread blocks of the scope.
+    id_.store(0, std::memory_order_relaxed);
+
+    releaseInstances();
+
+#if DI_CHECK_BORROWED_REFS
+    if (auto n = borrowedRefs_.load(); n > 0)
+    {
+        std::fprintf(stderr, "di: scope reset while %zu BorrowedServiceRef(s) to its instances are alive\n", n);
+        std::abort();
+    }
+#endif
+
+    if (arena_)
+        arena_->reset();
+}
+
+void ScopeState::releaseInstances()
+{
+    // Per-thread instances may borrow shared ones, so they go first. Their threads may still be running.
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        releasingBlocks_.swap(perThreadBlocks_);
+    }
+
+    for (auto& block : releasingBlocks_)
+        block->release();
+
+    releasingBlocks_.clear();
+
+    // Dependencies complete their construction first, so the reverse order lets destructors still use them.
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        releasingSlots_.swap(constructed_);
+    }
+
+    for (auto it = releasingSlots_.rbegin(); it != releasingSlots_.rend(); ++it)
+        (*it)->take().reset();
+
+    releasingSlots_.clear();
+}
+
+std::vector<InstanceSlot*> ScopeState::takeConstructed()
+{
+    std::vector<InstanceSlot*> slots;
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    slots.swap(constructed_);
+    return slots;
+}
+
+ArenaStats ScopeState::arenaStats() const
+{
+    return arena_ ? arena_->stats() : ArenaStats{};
+}
+
+ValidationReport ScopeState::validate(const ValidationOptions& options)
+{
+    using Node = std::pair<ScopeState*, const ImplData*>;
+    enum class Mark { visiting, done };
+
+    ValidationReport report;
+
+    // The visible bindings, i.e. the closest one for each interface.
+    std::vector<Node> visible;
+    std::vector<bool> shadowed;
+
+    for (ScopeState* scope = this; scope != nullptr; scope = scope->parent_)
+    {
+        if (!scope->bindings_)
+            continue;
+
+        const auto& impls = scope->bindings_->impls;
+
+        if (shadowed.size() < impls.size())
+            shadowed.resize(impls.size(), false);
+
+        for (TypeId interfaceType = 0; interfaceType < impls.size(); ++interfaceType)
+        {
+            if (impls[interfaceType].empty() || shadowed[interfaceType])
+                continue;
+
+            shadowed[interfaceType] = true;
+            visible.push_back({scope, &impls[interfaceType].back()});
+        }
+    }
+
+    // Depth-first search over declared dependencies, which are resolved from the scope that owns the dependent.
+    std::map<Node, Mark> marks;
+    std::vector<Node> path;
+    std::vector<Node> order;
+
+    auto visit = [&](auto& self, Node node) -> void
+    {
+        marks[node] = Mark::visiting;
+        path.push_back(node);
+
+        if (const auto* dependencies = node.second->dependencies)
+        {
+            for (const Dependency& dependency : *dependencies)
+            {
+                Node target = node.first->lookupImpl(dependency.interfaceType);
+
+                if (target.second == nullptr)
+                {
+                    report.missingBindings.push_back({typeName(*node.second->interfaceType), typeName(*dependency.type)});
+                    continue;
+                }
+
+                // Lazy dependencies are resolved after construction, so they can't be part of cycles.
+                if (dependency.lazy)
+                    continue;
+
+                auto it = marks.find(target);
+
+                if (it == marks.end())
+                {
+                    self(self, target);
+                }
+                else if (it->second == Mark::visiting)
+                {
+                    std::string cycle;
+                    for (auto p = std::find(path.begin(), path.end(), target); p != path.end(); ++p)
+                        cycle += typeName(*p->second->interfaceType) + " -> ";
+
+                    cycle += typeName(*target.second->interfaceType);
+                    report.cycles.push_back(std::move(cycle));
+                }
+            }
+        }
+
+        path.pop_back();
+        marks[node] = Mark::done;
+        order.push_back(node);
+    };
+
+    std::map<Node, std::size_t> serviceIndices;
+
+    for (const Node& node : visible)
+    {
+        if (marks.find(node) == marks.end())
+            visit(visit, node);
+
+        serviceIndices.emplace(node, report.services.size());
+
+        auto& service = report.services.emplace_back();
+        service.interfaceName = typeName(*node.second->interfaceType);
+        service.inherited = node.first != this;
+        service.dependenciesKnown = node.second->dependencies != nullptr;
+        service.instanceSize = node.second->implSize;
+    }
+
+    if (!options.construct)
+        return report;
+
+    // Dependencies come first in depth-first post-order, so each construction is measured on its own.
+    for (const Node& node : order)
+    {
+        auto it = serviceIndices.find(node);
+        if (node.first != this || it == serviceIndices.end() || hasInstance(node.second->sharedInstanceType))
+            continue;
+
+        auto& service = report.services[it->second];
+        std::size_t arenaBytes = arenaStats().bytes;
+        auto start = std::chrono::steady_clock::now();
+
+        try
+        {
+            instantiate(*node.second);
+        }
+        catch (const std::exception& e)
+        {
+            report.errors.push_back(service.interfaceName + ": " + e.what());
+            continue;
+        }
+
+        service.constructed = true;
+        service.constructionTime = std::chrono::steady_clock::now() - start;
+        service.arenaBytes = arenaStats().bytes - arenaBytes;
+    }
+
+    return report;
 }
 
-void ScopeState::setServiceImpl(std::type_index interfaceType, const ImplData& impl)
+InstanceSlot& ScopeState::instanceSlot(TypeId instanceType)
 {
-    serviceImpls_[interfaceType] = impl;
+    if (auto* slot = serviceInstances_.find(instanceType))
+        return *slot;
+
+    std::scoped_lock lock(mtx_);
+    return serviceInstances_.get(instanceType);
 }
 
+namespace {
+
+// Scopes active on this thread. ScopeStack::top_ caches the last element.
+thread_local std::vector<ScopeState*> activeScopes;
+// Whether this thread installed the process root.
+thread_local bool ownsRoot = false;
+
+} // namespace
+
 void ScopeStack::push(ScopeState& scope)
 {
-    scopes_.push_back(&scope);
+    if (activeScopes.empty())
+    {
+        ScopeState* expected = nullptr;
+        ownsRoot = root_.compare_exchange_strong(expected, &scope);
+    }
+
+    activeScopes.push_back(&scope);
+    top_ = &scope;
 }
 
 void ScopeStack::pop(ScopeState& scope)
 {
-    if (scopes_.back() != &scope)
+    if (top_ != &scope)
         throw std::runtime_error("detected mismatched dependency scope stack");
 
-    scopes_.pop_back();
+    activeScopes.pop_back();
+    top_ = activeScopes.empty() ? nullptr : activeScopes.back();
+
+    if (activeScopes.empty() && ownsRoot)
+    {
+        root_.store(nullptr);
+        ownsRoot = false;
+    }
 }
 
-ScopeState& ScopeStack::top()
+ScopeState& ScopeStack::root()
 {
-    if (scopes_.empty())
-        throw std::runtime_error("no active dependency scope");
+    if (ScopeState* scope = root_.load(std::memory_order_acquire))
+        return *scope;
+
+    throw std::runtime_error("no active dependency scope");
+}
+
+CoroutineScopes::CoroutineScopes() :
+    outer_{ScopeStack::tryTop()},
+    base_{activeScopes.size()}
+{}
+
+void CoroutineScopes::suspend()
+{
+    if (suspended_)
+        return;
+
+    std::size_t own = base_ + (outerPushed_ ? 1 : 0);
+    if (activeScopes.size() < own)
+        throw std::runtime_error("detected mismatched dependency scope stack");
+
+    inner_.assign(activeScopes.begin() + static_cast<std::ptrdiff_t>(own), activeScopes.end());
+
+    while (activeScopes.size() > base_)
+        ScopeStack::pop(*activeScopes.back());
+
+    outerPushed_ = false;
+    suspended_ = true;
+}
+
+void CoroutineScopes::resume()
+{
+    if (!suspended_)
+        return;
+
+    base_ = activeScopes.size();
+
+    outerPushed_ = outer_ != nullptr && ScopeStack::tryTop() != outer_;
+    if (outerPushed_)
+        ScopeStack::push(*outer_);
+
+    for (ScopeState* scope : inner_)
+        ScopeStack::push(*scope);
 
-    return *scopes_.back();
+    inner_.clear();
+    suspended_ = false;
 }
 
-ScopeGuard::ScopeGuard(ScopeStack& stack, ScopeState& scope) :
-    stack_{&stack},
+ScopeActivation::ScopeActivation(ScopeState& scope) :
+    scope_{ScopeStack::tryTop() != &scope ? &scope : nullptr}
+{
+    if (scope_ != nullptr)
+        ScopeStack::push(*scope_);
+}
+
+ScopeActivation::~ScopeActivation()
+{
+    if (scope_ != nullptr)
+        ScopeStack::pop(*scope_);
+}
+
+ScopeGuard::ScopeGuard(ScopeState& scope) :
     scope_{&scope}
 {
-    stack.push(scope);
+    ScopeStack::push(scope);
 }
 
 ScopeGuard::~ScopeGuard()
 {
-    if (stack_ != nullptr && scope_ != nullptr)
-        stack_->pop(*scope_);
+    if (scope_ != nullptr)
+        ScopeStack::pop(*scope_);
+}
+
+WarmUp::WarmUp(ScopeState& scope) :
+    scope_{scope}
+{
+    const BindingTable* table = scope.bindings();
+    if (table == nullptr)
+        return;
+
+    // Nodes are the shared instances bound by this scope.
+    std::vector<const ImplData*> nodes;
+    std::unordered_map<TypeId, std::size_t> nodeByInstance;
+
+    for (const auto& impls : table->impls)
+    {
+        if (impls.empty())
+            continue;
+
+        nodeByInstance.emplace(impls.back().sharedInstanceType, nodes.size());
+        nodes.push_back(&impls.back());
+    }
+
+    // Edges are the declared dependencies between them. Others are resolved on demand.
+    std::vector<std::size_t> dependencyCounts(nodes.size(), 0);
+    std::vector<std::vector<std::size_t>> dependents(nodes.size());
+
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+    {
+        if (nodes[i]->dependencies == nullptr)
+            continue;
+
+        for (const Dependency& dependency : *nodes[i]->dependencies)
+        {
+            if (!dependency.cached || dependency.lazy)
+                continue;
+
+            auto it = nodeByInstance.find(dependency.instanceType);
+            if (it == nodeByInstance.end() || it->second == i)
+                continue;
+
+            ++dependencyCounts[i];
+            dependents[it->second].push_back(i);
+        }
+    }
+
+    std::vector<std::size_t> current;
+    std::vector<std::size_t> next;
+    std::size_t placed = 0;
+
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+        if (dependencyCounts[i] == 0)
+            current.push_back(i);
+
+    while (!current.empty())
+    {
+        auto& wave = waves_.emplace_back();
+
+        for (std::size_t node : current)
+        {
+            wave.push_back(nodes[node]);
+            ++placed;
+
+            for (std::size_t dependent : dependents[node])
+                if (--dependencyCounts[dependent] == 0)
+                    next.push_back(dependent);
+        }
+
+        current.swap(next);
+        next.clear();
+    }
+
+    // The remaining nodes are part of cycles. Creating them reports the cycle.
+    if (placed < nodes.size())
+    {
+        auto& wave = waves_.emplace_back();
+
+        for (std::size_t i = 0; i < nodes.size(); ++i)
+            if (dependencyCounts[i] > 0)
+                wave.push_back(nodes[i]);
+    }
+}
+
+void WarmUp::run(const ImplData* impl) noexcept
+{
+    std::exception_ptr error;
+
+    try
+    {
+        scope_.instantiate(*impl);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+
+    finishTask(error);
+}
+
+Teardown::Teardown(ScopeState& scope) :
+    nodes_{scope.takeConstructed()},
+    services_(nodes_.size())
+{
+    std::unordered_map<const InstanceSlot*, std::size_t> nodeBySlot;
+    for (std::size_t i = 0; i < nodes_.size(); ++i)
+        nodeBySlot.emplace(nodes_[i], i);
+
+    // Edges point from an instance to its dependencies, which were constructed before it, so there are no cycles.
+    std::vector<std::size_t> dependentCounts(nodes_.size(), 0);
+    std::vector<std::vector<std::size_t>> dependencies(nodes_.size());
+
+    for (std::size_t i = 0; i < nodes_.size(); ++i)
+    {
+        for (const InstanceSlot* slot : nodes_[i]->dependencies)
+        {
+            auto it = nodeBySlot.find(slot);
+            if (it == nodeBySlot.end() || it->second == i)
+                continue;
+
+            auto& edges = dependencies[i];
+            if (std::find(edges.begin(), edges.end(), it->second) != edges.end())
+                continue;
+
+            edges.push_back(it->second);
+            ++dependentCounts[it->second];
+        }
+    }
+
+    // Within a wave, the most recently constructed instances go first.
+    std::vector<std::size_t> current;
+    std::vector<std::size_t> next;
+
+    for (std::size_t i = nodes_.size(); i-- > 0;)
+        if (dependentCounts[i] == 0)
+            current.push_back(i);
+
+    while (!current.empty())
+    {
+        auto& wave = waves_.emplace_back();
+
+        for (std::size_t node : current)
+        {
+            wave.push_back(node);
+
+            services_[node].interfaceName = typeName(*nodes_[node]->type);
+            services_[node].wave = waves_.size() - 1;
+
+            for (std::size_t dependency : dependencies[node])
+                if (--dependentCounts[dependency] == 0)
+                    next.push_back(dependency);
+        }
+
+        std::sort(next.begin(), next.end(), std::greater<>());
+        current.swap(next);
+        next.clear();
+    }
+}
+
+void Teardown::run(std::size_t node) noexcept
+{
+    InstanceSlot& slot = *nodes_[node];
+    ShutdownReport::Service& service = services_[node];
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::shared_ptr<void> instance = slot.take();
+    service.destroyed = instance.use_count() == 1;
+    instance.reset();
+
+    service.destructionTime = std::chrono::steady_clock::now() - start;
+
+    finishTask(nullptr);
+}
+
+ShutdownReport Teardown::report() const
+{
+    ShutdownReport report;
+    report.waves = waves_.size();
+
+    for (const auto& wave : waves_)
+        for (std::size_t node : wave)
+            report.services.push_back(services_[node]);
+
+    return report;
+}
+
+void TaskGroup::addTask()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    ++pendingTasks_;
+}
+
+void TaskGroup::removeTask()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (--pendingTasks_ == 0)
+        cv_.notify_all();
+}
+
+void TaskGroup::finishTask(std::exception_ptr error) noexcept
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    if (error && !error_)
+        error_ = error;
+
+    // Notify while holding the lock, since the waiter destroys this object once it returns.
+    if (--pendingTasks_ == 0)
+        cv_.notify_all();
+}
+
+void TaskGroup::wait()
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_.wait(lock, [this] { return pendingTasks_ == 0; });
+
+    if (error_)
+        std::rethrow_exception(error_);
+}
+
+void TaskGroup::drain() noexcept
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_.wait(lock, [this] { return pendingTasks_ == 0; });
+}
+
+} // namespace di::detail
+
+
+namespace di {
+
+ScopeContext ScopeContext::capture()
+{
+    return ScopeContext{detail::ScopeStack::top()};
+}
+
+ScopeContext::ScopeContext(detail::ScopeState& scope) :
+    scope_{&scope},
+    id_{scope.id()}
+{
+#if DI_CHECK_BORROWED_REFS
+    scope_->addBorrowedRef();
+#endif
+}
+
+ScopeContext::ScopeContext(const ScopeContext& other) :
+    scope_{other.scope_},
+    id_{other.id_}
+{
+#if DI_CHECK_BORROWED_REFS
+    scope_->addBorrowedRef();
+#endif
+}
+
+ScopeContext& ScopeContext::operator=(const ScopeContext& other)
+{
+#if DI_CHECK_BORROWED_REFS
+    other.scope_->addBorrowedRef();
+    scope_->removeBorrowedRef();
+#endif
+    scope_ = other.scope_;
+    id_ = other.id_;
+    return *this;
+}
+
+ScopeContext::~ScopeContext()
+{
+#if DI_CHECK_BORROWED_REFS
+    scope_->removeBorrowedRef();
+#endif
+}
+
+detail::ScopeState& ScopeContext::scope() const
+{
+    if (scope_->id() != id_)
+        throw std::runtime_error("scope context refers to a destroyed scope");
+
+    return *scope_;
+}
+
+ValidationReport Scope::validate(const ValidationOptions& options)
+{
+    return state_.validate(options);
 }
 
-ScopeStack globalScopeStack;
+ShutdownReport Scope::shutdown()
+{
+    return shutdown([](auto task) { task(); });
+}
+
+void Scope::reset()
+{
+    state_.reset();
+}
+
+ArenaStats Scope::arenaStats() const
+{
+    return state_.arenaStats();
+}
+
+PooledScope ScopePool::acquire()
+{
+    std::unique_ptr<detail::ScopeState> state;
+
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+
+        if (!idle_.empty())
+        {
+            state = std::move(idle_.back());
+            idle_.pop_back();
+        }
+    }
+
+    if (!state)
+        state = std::make_unique<detail::ScopeState>(parent_, bindings_, options_);
+
+    return PooledScope{*this, std::move(state)};
+}
+
+std::size_t ScopePool::idleCount() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return idle_.size();
+}
+
+void ScopePool::recycle(std::unique_ptr<detail::ScopeState> state) noexcept
+{
+    state->reset();
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    idle_.push_back(std::move(state));
+}
+
+PooledScope::PooledScope(ScopePool& pool, std::unique_ptr<detail::ScopeState> state) :
+    pool_{pool},
+    state_{std::move(state)}
+{
+    detail::ScopeStack::push(*state_);
+}
+
+PooledScope::~PooledScope()
+{
+    detail::ScopeStack::pop(*state_);
+    pool_.recycle(std::move(state_));
+}
+
+ArenaStats PooledScope::arenaStats() const
+{
+    return state_->arenaStats();
+}
+
+std::chrono::nanoseconds ValidationReport::totalConstructionTime() const
+{
+    std::chrono::nanoseconds total{0};
+    for (const Service& service : services)
+        total += service.constructionTime;
+
+    return total;
+}
+
+std::string ValidationReport::toString() const
+{
+    std::string result;
+
+    for (const MissingBinding& missing : missingBindings)
+        result += "missing binding: " + missing.interfaceName + " (required by " + missing.dependentName + ")\n";
+
+    for (const std::string& cycle : cycles)
+        result += "circular dependency: " + cycle + "\n";
+
+    for (const std::string& error : errors)
+        result += "construction failed: " + error + "\n";
+
+    for (const Service& service : services)
+    {
+        result += "service: " + service.interfaceName + ", " + std::to_string(service.instanceSize) + " bytes";
+
+        if (service.inherited)
+            result += ", inherited";
+
+        if (!service.dependenciesKnown)
+            result += ", undeclared dependencies";
+
+        if (service.constructed)
+        {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(service.constructionTime).count();
+            result += ", constructed in " + std::to_string(us) + " us";
+
+            if (service.arenaBytes > 0)
+                result += ", " + std::to_string(service.arenaBytes) + " arena bytes";
+        }
+
+        result += "\n";
+    }
+
+    return result;
+}
+
+std::string ShutdownReport::toString() const
+{
+    std::string result;
+
+    for (const Service& service : services)
+    {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(service.destructionTime).count();
+        result += "wave " + std::to_string(service.wave) + ": " + service.interfaceName;
+        result += service.destroyed ? ", destroyed in " + std::to_string(us) + " us" : ", still referenced";
+        result += "\n";
+    }
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(totalTime).count();
+    result += "shutdown: " + std::to_string(services.size()) + " services in " + std::to_string(waves) + " waves, "
+        + std::to_string(ms) + " ms\n";
+
+    return result;
+}
+
+ResolutionHooks* setResolutionHooks(ResolutionHooks* hooks)
+{
+    return detail::resolutionHooks.exchange(hooks, std::memory_order_acq_rel);
+}
+
+void ResolutionStats::cacheHit(const std::type_info& type) noexcept
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    entry(type).cacheHits += 1;
+}
+
+void ResolutionStats::cacheMiss(const std::type_info& type) noexcept
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    entry(type).cacheMisses += 1;
+}
+
+void ResolutionStats::constructionEnd(const std::type_info& type, std::chrono::nanoseconds duration, bool failed) noexcept
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    auto& e = entry(type);
+    e.constructions += 1;
+    e.failedConstructions += failed ? 1 : 0;
+    addConstructionTime(e, duration);
+}
+
+void ResolutionStats::exclusiveCreated(const std::type_info& type, std::chrono::nanoseconds duration) noexcept
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    auto& e = entry(type);
+    e.exclusiveCreations += 1;
+    addConstructionTime(e, duration);
+}
+
+std::vector<ResolutionStats::Interface> ResolutionStats::snapshot() const
+{
+    std::vector<Interface> result;
+
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+
+        for (const auto& entry : interfaces_)
+            result.push_back(entry.second);
+    }
+
+    std::sort(result.begin(), result.end(), [](const auto& a, const auto& b) { return a.interfaceName < b.interfaceName; });
+    return result;
+}
+
+void ResolutionStats::clear()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    interfaces_.clear();
+}
+
+std::string ResolutionStats::toString() const
+{
+    std::string result;
+
+    for (const Interface& e : snapshot())
+    {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(e.totalConstructionTime).count();
+
+        result += e.interfaceName + ": " + std::to_string(e.cacheHits) + " hits, " + std::to_string(e.cacheMisses) + " misses, "
+            + std::to_string(e.constructions) + " constructions (" + std::to_string(e.failedConstructions) + " failed), "
+            + std::to_string(e.exclusiveCreations) + " exclusive, " + std::to_string(us) + " us\n";
+
+        // Only the non-empty buckets, by upper bound.
+        for (std::size_t i = 0; i < bucketCount; ++i)
+        {
+            if (e.constructionTimes[i] == 0)
+                continue;
+
+            result += i + 1 < bucketCount ? "  < " + std::to_string(std::uint64_t{1} << i) + " us: " : "  more: ";
+            result += std::to_string(e.constructionTimes[i]) + "\n";
+        }
+    }
+
+    return result;
+}
+
+ResolutionStats::Interface& ResolutionStats::entry(const std::type_info& type)
+{
+    auto [it, inserted] = interfaces_.try_emplace(std::type_index(type));
+    if (inserted)
+        it->second.interfaceName = detail::typeName(type);
+
+    return it->second;
+}
+
+void ResolutionStats::addConstructionTime(Interface& e, std::chrono::nanoseconds duration)
+{
+    e.totalConstructionTime += duration;
+
+    auto us = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+
+    std::size_t bucket = 0;
+    while (bucket + 1 < bucketCount && us >= (std::uint64_t{1} << bucket))
+        ++bucket;
+
+    e.constructionTimes[bucket] += 1;
+}
 
-}
\ No newline at end of file
+} // namespace di
@@ -1,13 +1,54 @@
 #pragma once
 
-#include <functional>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <initializer_list>
+#include <optional>
 #include <memory>
+#include <memory_resource>
 #include <mutex>
-#include <shared_mutex>
+#include <new>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <unordered_map>
-#include <typeindex>
 #include <tuple>
+#include <type_traits>
+#include <typeindex>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#   include <coroutine>
+#   define DI_HAS_COROUTINES 1
+#else
+#   define DI_HAS_COROUTINES 0
+#endif
+
+/// If enabled, each scope counts the BorrowedServiceRefs to its instances,
+/// and aborts if any of them outlive it. Enabled by default in debug builds.
+/// Must be set consistently for all translation units.
+#ifndef DI_CHECK_BORROWED_REFS
+#   ifdef NDEBUG
+#       define DI_CHECK_BORROWED_REFS 0
+#   else
+#       define DI_CHECK_BORROWED_REFS 1
+#   endif
+#endif
+
+/// If enabled, service resolution calls the ResolutionHooks installed with setResolutionHooks.
+/// While none are installed, that costs a single branch per resolution. If disabled, hooks are never called,
+/// and resolution has no overhead for them. Disabled by default. Must be set consistently for all translation units.
+#ifndef DI_ENABLE_HOOKS
+#   define DI_ENABLE_HOOKS 0
+#endif
 
 
 namespace di {
@@ -15,299 +56,2438 @@ namespace di {
 class Bindings;
 class Scope;
 
-}// namespace di
+template <typename ... TBinds>
+class StaticBindings;
 
+namespace tags
+{
+    struct Exclusive {};
+    struct Shared {};
+    struct Pooled {};
+    struct PerThread {};
 
-namespace di::detail {
+    template <std::size_t N>
+    struct Sharded {};
 
-class BindingsState;
-class ScopeState;
+    struct PerCpu {};
+}
+
+template <typename TInterface, typename Tag>
+class ServiceRef;
+
+template <typename TInterface, typename Tag>
+class BorrowedServiceRef;
+
+template <typename TInterface, typename Tag>
+class LazyServiceRef;
+
+template <typename TInterface>
+class ServiceList;
 
-/// Helper class used to keep track of nested service construction in the current scope.
-/// If an instance is constructed more than once within the same call stack, there's a cycle.
-class CycleChecker
+/// Customizes how instances of TImpl are recycled when resolved with tags::Pooled.
+/// Specialize to change the pool capacity or to reset instances before they are re-used.
+template <typename TImpl>
+struct PoolTraits
 {
-public:
-    class Guard
-    {
-    public:
-        Guard(CycleChecker& parent, std::type_index ctorType) :
-            parent_{&parent},
-            ctorType_{ctorType}
-        {
-            std::scoped_lock lock(parent.mtx_);
+    /// Maximum number of idle instances kept per pool. Further released instances are destroyed.
+    static constexpr std::size_t capacity = 64;
 
-            if (auto e = parent.activeCtors_.find(ctorType); e != parent.activeCtors_.end())
-                throw std::runtime_error("circular dependency"); 
+    /// Called on each released instance before it is put back into the pool.
+    static void reset(TImpl&) {}
+};
 
-            parent_->activeCtors_.emplace(ctorType, true);
-        }
+/// Options to create a Scope with.
+struct ScopeOptions
+{
+    /// If non-zero, shared instances owned by the scope are allocated from a monotonic arena,
+    /// which grows in blocks of at least this many bytes and is released in bulk when the scope ends.
+    /// Instances must then not be referenced beyond the lifetime of their scope.
+    std::size_t arenaBlockSize = 0;
+};
 
-        ~Guard()
-        {
-            if (parent_)
-            {
-                std::scoped_lock lock(parent_->mtx_);
-                parent_->activeCtors_.erase(ctorType_);
-            }       
-        }
+/// Allocations served by a scope arena, each of which saved a heap allocation and deallocation.
+struct ArenaStats
+{
+    std::size_t allocations = 0;
+    std::size_t bytes = 0;
+};
+
+struct ValidationOptions
+{
+    /// Also create the shared instances bound by the scope, and measure their construction.
+    bool construct = false;
+};
+
+/// Result of Scope::validate.
+struct ValidationReport
+{
+    struct Service
+    {
+        std::string interfaceName;
+        /// Bound by an enclosing scope, rather than the validated one.
+        bool inherited = false;
+        /// Dependencies are only known for constructor-injected implementations.
+        bool dependenciesKnown = false;
+        /// Size of the implementation object.
+        std::size_t instanceSize = 0;
+
+        /// Set if the instance was created by validate(), rather than before.
+        bool constructed = false;
+        /// Excludes the construction of declared dependencies, which are created first.
+        std::chrono::nanoseconds constructionTime{0};
+        /// Allocated from the scope arena during construction, if the scope has one.
+        std::size_t arenaBytes = 0;
+    };
 
-    private:
-        CycleChecker* parent_;
-        std::type_index ctorType_;
+    struct MissingBinding
+    {
+        std::string dependentName;
+        std::string interfaceName;
     };
 
-    Guard makeGuard(std::type_index ctorType)
+    std::vector<Service> services;
+    std::vector<MissingBinding> missingBindings;
+    /// Each cycle is formatted as a path of interfaces, e.g. "A -> B -> A".
+    std::vector<std::string> cycles;
+    /// Errors thrown by constructing services, prefixed with the interface name.
+    std::vector<std::string> errors;
+
+    bool ok() const
     {
-        return Guard(*this, ctorType);
+        return missingBindings.empty() && cycles.empty() && errors.empty();
     }
 
-private:
-    std::mutex mtx_;
-    // Using map to avoid set include for this single use.
-    std::unordered_map<std::type_index, bool> activeCtors_;
+    std::chrono::nanoseconds totalConstructionTime() const;
+
+    std::string toString() const;
 };
 
+/// Result of Scope::shutdown.
+struct ShutdownReport
+{
+    struct Service
+    {
+        std::string interfaceName;
+        /// Index of the wave the instance was released in. Waves run one after another.
+        std::size_t wave = 0;
+        /// Set if the scope held the last reference, so the instance was destroyed when released.
+        bool destroyed = false;
+        std::chrono::nanoseconds destructionTime{0};
+    };
+
+    /// In order of release.
+    std::vector<Service> services;
+    std::size_t waves = 0;
+    std::chrono::nanoseconds totalTime{0};
 
-struct ImplData
+    std::string toString() const;
+};
+
+/// Callbacks on service resolution, see setResolutionHooks. Override the ones of interest.
+/// They are called on the resolving thread, possibly concurrently, with the interface type that was resolved.
+class ResolutionHooks
 {
-    std::function<std::shared_ptr<void>()> factory;
+public:
+    virtual ~ResolutionHooks() = default;
+
+    /// A shared or per-thread instance was found in the cache.
+    virtual void cacheHit(const std::type_info&) noexcept {}
+
+    /// A shared or per-thread instance was not found in the cache. It is created next, unless another thread
+    /// already does so.
+    virtual void cacheMiss(const std::type_info&) noexcept {}
+
+    virtual void constructionStart(const std::type_info&) noexcept {}
+
+    /// A shared or per-thread instance was created, or its constructor threw.
+    virtual void constructionEnd(const std::type_info&, std::chrono::nanoseconds, bool /*failed*/) noexcept {}
+
+    /// An instance was created for tags::Exclusive.
+    virtual void exclusiveCreated(const std::type_info&, std::chrono::nanoseconds) noexcept {}
 };
 
+/// Installs hooks to be called on service resolution, or removes them if null. Returns the previous hooks.
+/// Only has an effect if DI_ENABLE_HOOKS is set. Hooks must outlive their installation, including calls in progress.
+ResolutionHooks* setResolutionHooks(ResolutionHooks* hooks);
 
-class BindingsState
+/// ResolutionHooks that count resolutions per interface, with a histogram of construction times.
+/// Callbacks are serialized, so the counts are exact, but contended resolution is slowed down.
+class ResolutionStats : public ResolutionHooks
 {
 public:
-    template <typename TInterface, typename TImpl, typename ... TArgs>
-    void setService(TArgs&& ... args)
+    /// Bucket 0 counts constructions below 1 us, bucket i those below 2^i us. The last bucket counts the rest.
+    static constexpr std::size_t bucketCount = 24;
+
+    struct Interface
     {
-        auto interfaceType = std::type_index(typeid(TInterface));
-        auto implType = std::type_index(typeid(TImpl));
+        std::string interfaceName;
+        std::uint64_t cacheHits = 0;
+        std::uint64_t cacheMisses = 0;
+        std::uint64_t constructions = 0;
+        std::uint64_t failedConstructions = 0;
+        std::uint64_t exclusiveCreations = 0;
+        std::chrono::nanoseconds totalConstructionTime{0};
+        /// Includes failed constructions and exclusive creations.
+        std::array<std::uint64_t, bucketCount> constructionTimes{};
+    };
 
-        ImplData impl;
-        impl.factory = [storedArgs = std::make_tuple(std::forward<TArgs>(args) ...)] () -> std::shared_ptr<void> {
-            return std::apply([](const auto& ... args){
-                return std::make_shared<TImpl>(args ...);
-            }, storedArgs);
-        };
+    void cacheHit(const std::type_info& type) noexcept override;
+    void cacheMiss(const std::type_info& type) noexcept override;
+    void constructionEnd(const std::type_info& type, std::chrono::nanoseconds duration, bool failed) noexcept override;
+    void exclusiveCreated(const std::type_info& type, std::chrono::nanoseconds duration) noexcept override;
 
-        interfaceMap_[interfaceType][implType] = std::move(impl);
-    }
+    /// Returns the counts so far, by interface name.
+    std::vector<Interface> snapshot() const;
 
-    void registerAtScope(ScopeState& scope) const;
+    void clear();
 
-    static const BindingsState& fromBindings(const Bindings&);
-    static BindingsState& fromBindings(Bindings&);
+    std::string toString() const;
+
+private:
+    Interface& entry(const std::type_info& type);
+
+    void addConstructionTime(Interface& entry, std::chrono::nanoseconds duration);
+
+    mutable std::mutex mtx_;
+    std::unordered_map<std::type_index, Interface> interfaces_;
+};
+
+}// namespace di
+
+
+namespace di::detail {
+
+class BindingsState;
+class ScopeState;
+
+using TypeId = std::size_t;
+
+template <typename T>
+struct InjectedDependency;
+
+template <typename TImpl>
+struct Injector;
+
+/// Returns the CPU the calling thread runs on, or some stable per-thread index if unknown.
+std::size_t currentCpu();
+
+std::size_t cpuCount();
+
+/// Number of instances of a sharded service.
+template <typename Tag>
+struct ShardCount
+{
+    static constexpr bool sharded = false;
+};
+
+template <std::size_t N>
+struct ShardCount<tags::Sharded<N>>
+{
+    static_assert(N > 0, "sharded services need at least one shard");
+
+    static constexpr bool sharded = true;
+
+    static std::size_t get() { return N; }
+};
+
+template <>
+struct ShardCount<tags::PerCpu>
+{
+    static constexpr bool sharded = true;
+
+    static std::size_t get() { return cpuCount(); }
+};
+
+/// Whether instances resolved with Tag are cached in their scope, and shared by all threads.
+template <typename Tag>
+constexpr bool isCachedTag = !std::is_same_v<Tag, tags::Exclusive> && !std::is_same_v<Tag, tags::Pooled>
+    && !std::is_same_v<Tag, tags::PerThread> && !ShardCount<Tag>::sharded;
+
+/// Assigns dense, sequential ids to types on first use.
+/// Each TDomain has its own counter, so ids can directly index per-domain tables.
+template <typename TDomain>
+class TypeIds
+{
+public:
+    template <typename T>
+    static TypeId get()
+    {
+        static const TypeId id = next_.fetch_add(1, std::memory_order_relaxed);
+        return id;
+    }
+
+    static TypeId count()
+    {
+        return next_.load(std::memory_order_relaxed);
+    }
 
 private:
-    using ImplMap = std::unordered_map<std::type_index, ImplData>;
-    using InterfaceMap = std::unordered_map<std::type_index, ImplMap>;
-    
-    // InterfaceType -> ImplType -> ImplData
-    InterfaceMap interfaceMap_;
+    static inline std::atomic<TypeId> next_{0};
 };
 
+struct InterfaceDomain {};
+struct InstanceDomain {};
 
 template <typename Tag, typename U>
 struct TaggedType {};
 
-
-class ScopeState
+/// Grow-only table of T, addressed by index.
+/// Storage is split into chunks of doubling size, so slots never move once allocated.
+/// Lookups are lock-free; allocating new chunks must be serialized by the caller.
+template <typename T>
+class SlotTable
 {
 public:
-    template <typename TInterface, typename Tag>
-    std::shared_ptr<TInterface> getService()
+    SlotTable() = default;
+
+    SlotTable(const SlotTable&) = delete;
+    SlotTable& operator=(const SlotTable&) = delete;
+
+    ~SlotTable()
     {
-        auto interfaceType = std::type_index{typeid(TInterface)};
+        clear();
+    }
 
-        auto serviceEntry = serviceImpls_.find(interfaceType);
-        if (serviceEntry == serviceImpls_.end())
-            throw std::runtime_error("service interface is not bound");
+    /// Destroys all slots. Must not run concurrently with other operations.
+    void clear()
+    {
+        for (auto& chunk : chunks_)
+            delete[] chunk.exchange(nullptr, std::memory_order_relaxed);
+    }
 
-        // Create non-cached instance.
-        if constexpr (std::is_same_v<Tag, tags::Exclusive>)
-        {
-            return std::static_pointer_cast<TInterface>(serviceEntry->second.factory());
-        }
-        
-        auto instanceType = std::type_index{typeid(TaggedType<Tag, TInterface>)};
-        
-        // Check for tagged instance (read lock).
-        {
-            std::shared_lock lock(mtx_);
-            auto e = serviceInstances_.find(instanceType);
-            if (e != serviceInstances_.end())
-                return std::static_pointer_cast<TInterface>(e->second);
-        }
+    /// Returns the slot at index, or nullptr if it has not been allocated yet.
+    T* find(std::size_t index) const
+    {
+        auto [chunk, offset] = locate(index);
+        if (chunk >= chunkCount)
+            return nullptr;
 
-        auto cycleGuard = cycleChecker_.makeGuard(instanceType);
+        T* slots = chunks_[chunk].load(std::memory_order_acquire);
+        return slots != nullptr ? &slots[offset] : nullptr;
+    }
 
-        // Create instance.
-        std::shared_ptr<void> instance = serviceEntry->second.factory();
+    /// Returns the slot at index, allocating it if needed.
+    T& get(std::size_t index)
+    {
+        auto [chunk, offset] = locate(index);
+        if (chunk >= chunkCount)
+            throw std::length_error("slot index out of range");
 
-        // Check again, then set tagged instance (write lock).
+        T* slots = chunks_[chunk].load(std::memory_order_acquire);
+        if (slots == nullptr)
         {
-            std::unique_lock lock(mtx_);
-            auto e = serviceInstances_.find(instanceType);
-            if (e != serviceInstances_.end())
-                return std::static_pointer_cast<TInterface>(e->second);
-
-            serviceInstances_.emplace(instanceType, instance);
-            return std::static_pointer_cast<TInterface>(instance);
+            slots = new T[firstChunkSize << chunk];
+            chunks_[chunk].store(slots, std::memory_order_release);
         }
+
+        return slots[offset];
     }
 
-    void setServiceImpl(std::type_index interfaceType, const ImplData& impl);
+private:
+    static constexpr std::size_t firstChunkSize = 8;
+    static constexpr std::size_t chunkCount = 32;
 
-    static const ScopeState& fromScope(const Scope&);
-    static ScopeState& fromScope(Scope&);
+    static std::size_t floorLog2(std::size_t x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(x);
+#else
+        std::size_t r = 0;
+        while (x >>= 1)
+            ++r;
+        return r;
+#endif
+    }
 
-private:
-    std::shared_mutex mtx_;
+    // Chunk k holds (firstChunkSize << k) slots, starting at index firstChunkSize * (2^k - 1).
+    static std::pair<std::size_t, std::size_t> locate(std::size_t index)
+    {
+        std::size_t chunk = floorLog2(index / firstChunkSize + 1);
+        if (chunk >= chunkCount)
+            return {chunk, 0};
+
+        return {chunk, index - firstChunkSize * ((std::size_t{1} << chunk) - 1)};
+    }
 
-    std::unordered_map<std::type_index, std::shared_ptr<void>> serviceInstances_;
-    std::unordered_map<std::type_index, ImplData> serviceImpls_;
-    CycleChecker cycleChecker_;
+    std::array<std::atomic<T*>, chunkCount> chunks_{};
 };
 
+inline std::atomic<ResolutionHooks*> resolutionHooks{nullptr};
 
-class ScopeStack
+/// Returns the installed hooks, or null. Always null if DI_ENABLE_HOOKS is not set.
+inline ResolutionHooks* activeHooks()
+{
+#if DI_ENABLE_HOOKS
+    return resolutionHooks.load(std::memory_order_acquire);
+#else
+    return nullptr;
+#endif
+}
+
+template <typename TInterface>
+TypeId interfaceId()
+{
+    return TypeIds<InterfaceDomain>::get<TInterface>();
+}
+
+template <typename TInterface, typename Tag>
+TypeId instanceId()
+{
+    return TypeIds<InstanceDomain>::get<TaggedType<Tag, TInterface>>();
+}
+
+/// Thread-safe monotonic allocator, owned by a scope.
+class ScopeArena
 {
 public:
-    void push(ScopeState& scope);
+    explicit ScopeArena(std::size_t blockSize);
 
-    void pop(ScopeState& scope);
+    ScopeArena(const ScopeArena&) = delete;
+    ScopeArena& operator=(const ScopeArena&) = delete;
 
-    ScopeState& top();
+    void* allocate(std::size_t bytes, std::size_t alignment);
+
+    ArenaStats stats() const;
+
+    /// Releases all allocations. The first block grows to hold what was allocated so far,
+    /// so a scope that is reset and used alike again allocates from it alone.
+    /// Must not run concurrently with other operations.
+    void reset();
 
 private:
-    std::vector<ScopeState*> scopes_;
+    mutable std::mutex mtx_;
+    std::size_t blockSize_;
+    std::unique_ptr<std::byte[]> buffer_;
+    std::size_t bufferSize_ = 0;
+    std::optional<std::pmr::monotonic_buffer_resource> resource_;
+    ArenaStats stats_;
 };
 
 
-class ScopeGuard
+/// Allocates from a ScopeArena. Deallocation is a no-op; memory is released with the arena.
+template <typename T>
+struct ArenaAllocator
 {
-public:
-    ScopeGuard(ScopeStack& stack, ScopeState& scope);
+    using value_type = T;
 
-    ~ScopeGuard();
+    explicit ArenaAllocator(ScopeArena* arena) :
+        arena{arena}
+    {}
 
-private:
-    ScopeStack* stack_;
-    ScopeState* scope_;
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) :
+        arena{other.arena}
+    {}
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, std::size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+    ScopeArena* arena;
 };
 
-extern ScopeStack globalScopeStack;
 
+struct ImplData;
 
-template <typename TInterface, typename Tag>
-std::shared_ptr<TInterface> getService()
+constexpr std::size_t cacheLineSize = 64;
+
+/// Allocates whole cache lines, so that objects don't share them with others.
+template <typename T>
+struct CacheLineAllocator
 {
-    auto& scope = globalScopeStack.top();
-    return scope.getService<TInterface, Tag>();
-}
+    using value_type = T;
 
-} // namespace di::detail
+    CacheLineAllocator() = default;
 
+    template <typename U>
+    CacheLineAllocator(const CacheLineAllocator<U>&) {}
 
-namespace di {
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(::operator new(roundUp(n * sizeof(T)), std::align_val_t{cacheLineSize}));
+    }
 
-/// Bindings define which implementation and arguments to use when instantiating an interface.
-class Bindings
-{
-public:
-    template <typename TInterface, typename TImpl, typename ... TArgs>
-    Bindings& service(TArgs&& ... args)
+    void deallocate(T* p, std::size_t n)
     {
-        state_.setService<TInterface, TImpl>(std::forward<TArgs>(args) ...);
-        return *this;
+        ::operator delete(p, roundUp(n * sizeof(T)), std::align_val_t{cacheLineSize});
     }
 
-private:
-    detail::BindingsState state_;
+    static std::size_t roundUp(std::size_t size)
+    {
+        return (size + cacheLineSize - 1) / cacheLineSize * cacheLineSize;
+    }
 
-    friend class detail::BindingsState;
+    template <typename U>
+    bool operator==(const CacheLineAllocator<U>&) const { return true; }
+
+    template <typename U>
+    bool operator!=(const CacheLineAllocator<U>&) const { return false; }
 };
 
 
-/// Scope selects the bindings to be used in the current execution scope.
-///
-/// For the duration of its lifetime, the Scope instance is added to the global stack of active scopes.
-/// Scopes must be destroyed in the inverse order of their creation, otherwise a runtime error is thrown.
-class Scope
+/// The instances of a sharded service within a scope.
+class ShardSet
 {
 public:
-    template <typename ... TBindings>
-    explicit Scope(const TBindings& ... bindings) :
-        guard_{detail::globalScopeStack, state_}
+    /// Instances are created with owner as active scope.
+    ShardSet(const ImplData& impl, ScopeState& owner, std::size_t count);
+
+    ShardSet(const ShardSet&) = delete;
+    ShardSet& operator=(const ShardSet&) = delete;
+
+    std::size_t size() const
     {
-        using detail::BindingsState;
-        (BindingsState::fromBindings(bindings).registerAtScope(state_), ...);
+        return shards_.size();
     }
 
-    Scope(const Scope&) = delete;
-    Scope& operator=(const Scope&) = delete;
-
-    Scope(Scope&&) = delete;
-    Scope& operator=(Scope&&) = delete;
+    const std::shared_ptr<void>& at(std::size_t i) const
+    {
+        return shards_[i];
+    }
 
-    void validate();
+    /// Returns the shard for the CPU the calling thread runs on.
+    const std::shared_ptr<void>& local() const
+    {
+        return shards_[currentCpu() % shards_.size()];
+    }
 
 private:
-    detail::ScopeState state_;
-    detail::ScopeGuard guard_;
-
-    friend class detail::ScopeState;
+    std::vector<std::shared_ptr<void>> shards_;
 };
 
 
-namespace tags
+/// A raw instance, owned by an ObjectPool while it is idle.
+struct PooledObject
 {
-    struct Exclusive {};
-    struct Shared {};
-}
+    void* instance = nullptr;
+    // The same instance, as pointer to the interface it was bound to.
+    void* iface = nullptr;
+};
 
-/// A ServiceRef obtains a service instance of the given interface type.
-///
-/// The bindings of the top-most active scope are used to select an implementation.
-/// If no implementation is bound, a runtime error is thrown.
-///
-/// Depending on the Tag template parameter, the instance may be cached and shared within
-/// the active scope.
-///
-/// If tagged with tags::Unique, a new instance is created exclusively for this ServiceRef.
-///
-/// Otherwise, the tag type denotes the name under which the instance is shared.
-/// A shared instance is created on first reference, then cached and re-used on further ones.
-/// Once created, it remains cached until its active scope is destroyed.
-/// By default, ServiceRefs are shared under the name tags::Shared; user-defined tags can be used as well.
-/// Dependencies between shared instances must not result in cycles, otherwise a runtime error is thrown.
-template <typename TInterface, typename Tag = tags::Shared>
-class ServiceRef
+/// Type-erased operations to create, reset and destroy raw instances of a bound implementation.
+struct PoolOps
+{
+    PooledObject (*create)(const void* args, ScopeState& scope);
+    void (*reset)(void* instance);
+    void (*destroy)(void* instance);
+    std::size_t capacity;
+};
+
+/// Recycles released instances of one binding within a scope.
+/// Idle instances are kept in a fixed number of shards, each of which a thread is assigned to,
+/// so threads mostly re-use instances they released themselves without contending with each other.
+/// Control blocks of the returned shared_ptrs are recycled as well.
+/// Pooled instances must be released before the pool (i.e. its scope) is destroyed.
+class ObjectPool
 {
 public:
-    ServiceRef() :
-        ptr_{detail::getService<TInterface, Tag>()}
-    {}
+    /// New instances are created with owner as active scope.
+    ObjectPool(const ImplData& impl, ScopeState& owner, const std::type_info& type);
 
-    ServiceRef(const ServiceRef&) = default;
-    ServiceRef& operator=(const ServiceRef&) = default;
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
 
-    ServiceRef(ServiceRef&&) = default;
-    ServiceRef& operator=(ServiceRef&&) = default;
+    ~ObjectPool();
 
-    const TInterface& operator*() const { return ptr_.operator*(); }
+    template <typename TInterface>
+    std::shared_ptr<TInterface> acquire()
+    {
+        PooledObject obj = take();
+        return std::shared_ptr<TInterface>(static_cast<TInterface*>(obj.iface), Recycler{this, obj}, BlockAllocator<TInterface>{this});
+    }
 
-    TInterface& operator*() { return ptr_.operator*(); }
+private:
+    struct Shard;
 
-    const TInterface* operator->() const { return ptr_.operator->(); }
+    struct Recycler
+    {
+        template <typename T>
+        void operator()(T*) const { pool->recycle(obj); }
 
-    TInterface* operator->() { return ptr_.operator->(); }
+        ObjectPool* pool;
+        PooledObject obj;
+    };
 
-    operator std::shared_ptr<TInterface>() const { return ptr_; }
+    template <typename T>
+    struct BlockAllocator
+    {
+        using value_type = T;
 
-private:
-    std::shared_ptr<TInterface> ptr_;
-};
+        explicit BlockAllocator(ObjectPool* pool) :
+            pool{pool}
+        {}
 
-}// namespace di
+        template <typename U>
+        BlockAllocator(const BlockAllocator<U>& other) :
+            pool{other.pool}
+        {}
+
+        T* allocate(std::size_t n) { return static_cast<T*>(pool->allocateBlock(n * sizeof(T))); }
+
+        void deallocate(T* p, std::size_t n) { pool->deallocateBlock(p, n * sizeof(T)); }
+
+        template <typename U>
+        bool operator==(const BlockAllocator<U>& other) const { return pool == other.pool; }
+
+        template <typename U>
+        bool operator!=(const BlockAllocator<U>& other) const { return pool != other.pool; }
+
+        ObjectPool* pool;
+    };
+
+    /// Returns an idle instance, or creates a new one.
+    PooledObject take();
+
+    void recycle(PooledObject obj);
+
+    void* allocateBlock(std::size_t size);
+    void deallocateBlock(void* p, std::size_t size);
+
+    Shard& localShard();
+
+    const PoolOps* ops_;
+    std::shared_ptr<const void> args_;
+    ScopeState* owner_;
+    const std::type_info* type_;
+    std::size_t shardCapacity_;
+    std::atomic<std::size_t> blockSize_{0};
+    std::unique_ptr<Shard[]> shards_;
+};
+
+
+/// A dependency injected into the constructor of an implementation.
+struct Dependency
+{
+    TypeId interfaceType;
+    // Only meaningful if cached.
+    TypeId instanceType;
+    bool cached;
+    // Resolved on first use, rather than during construction.
+    bool lazy;
+    const std::type_info* type;
+};
+
+/// Dependencies injected into the constructor of TImpl.
+/// They are determined at compile time, and registered during static initialization (see Injector).
+template <typename TImpl>
+std::vector<Dependency>& injectedDependencies()
+{
+    static std::vector<Dependency> dependencies;
+    return dependencies;
+}
+
+template <typename TImpl, typename TInterface, typename Tag, bool lazy>
+struct DependencyRegistration
+{
+    static inline const bool registered = [] {
+        injectedDependencies<TImpl>().push_back({interfaceId<TInterface>(), instanceId<TInterface, Tag>(), isCachedTag<Tag>, lazy, &typeid(TInterface)});
+        return true;
+    }();
+};
+
+constexpr std::size_t maxInjectedDependencies = 16;
+
+template <typename TImpl, std::size_t>
+using InjectorArg = Injector<TImpl>;
+
+template <typename TImpl, std::size_t ... Is>
+constexpr bool isInjectable(std::index_sequence<Is ...>)
+{
+    return std::is_constructible_v<TImpl, InjectorArg<TImpl, Is> ...>;
+}
+
+template <typename TImpl, std::size_t N = 1>
+constexpr std::size_t findInjectionArity()
+{
+    if constexpr (N > maxInjectedDependencies)
+        return 0;
+    else if constexpr (isInjectable<TImpl>(std::make_index_sequence<N>{}))
+        return N;
+    else
+        return findInjectionArity<TImpl, N + 1>();
+}
+
+/// Number of dependencies to inject into the constructor of TImpl, if it is bound without arguments.
+/// Default constructible implementations don't get any.
+template <typename TImpl>
+constexpr std::size_t injectionArity()
+{
+    if constexpr (std::is_default_constructible_v<TImpl>)
+        return 0;
+    else
+        return findInjectionArity<TImpl>();
+}
+
+
+struct ImplData
+{
+    using Factory = std::shared_ptr<void> (*)(const void* args, ScopeState& scope, ScopeArena* arena);
+    using IsolatedFactory = std::shared_ptr<void> (*)(const void* args, ScopeState& scope);
+
+    /// Creates an instance, returned as pointer to the interface it was bound to.
+    /// Injected dependencies are resolved from the given scope.
+    /// If an arena is given, the instance is allocated from it.
+    std::shared_ptr<void> create(ScopeState& scope, ScopeArena* arena = nullptr) const
+    {
+        return factory(args.get(), scope, arena);
+    }
+
+    /// Like create, but the instance occupies cache lines of its own.
+    std::shared_ptr<void> createIsolated(ScopeState& scope) const
+    {
+        return isolatedFactory(args.get(), scope);
+    }
+
+    TypeId implType;
+    // Instance of the bound interface that is shared under tags::Shared.
+    TypeId sharedInstanceType;
+    const std::type_info* interfaceType;
+    std::size_t implSize;
+    Factory factory;
+    IsolatedFactory isolatedFactory;
+    const PoolOps* poolOps;
+    // Constructor-injected dependencies, or nullptr if there are none.
+    const std::vector<Dependency>* dependencies = nullptr;
+    // Type-erased tuple of constructor arguments, shared between copies. Empty if there are none.
+    std::shared_ptr<const void> args;
+};
+
+
+/// Bound implementations, indexed by interface id.
+/// Once a table is shared with a scope, it is no longer modified.
+struct BindingTable
+{
+    const ImplData* find(TypeId interfaceType) const
+    {
+        if (interfaceType >= impls.size() || impls[interfaceType].empty())
+            return nullptr;
+
+        // The most recently bound implementation is used.
+        return &impls[interfaceType].back();
+    }
+
+    // InterfaceId -> ImplData, in binding order
+    std::vector<std::vector<ImplData>> impls;
+};
+
+
+class BindingsState
+{
+public:
+    template <typename TInterface, typename TImpl, typename ... TArgs>
+    void setService(TArgs&& ... args)
+    {
+        using ArgsTuple = std::tuple<std::decay_t<TArgs> ...>;
+
+        ImplData impl;
+        impl.implType = TypeIds<ImplDomain>::get<TImpl>();
+        impl.sharedInstanceType = instanceId<TInterface, tags::Shared>();
+        impl.interfaceType = &typeid(TInterface);
+        impl.implSize = sizeof(TImpl);
+        impl.factory = &create<TInterface, TImpl, ArgsTuple>;
+        impl.isolatedFactory = &createIsolated<TInterface, TImpl, ArgsTuple>;
+        impl.poolOps = &poolOps<TInterface, TImpl, ArgsTuple>;
+
+        if constexpr (sizeof ... (TArgs) > 0)
+            impl.args = std::make_shared<const ArgsTuple>(std::forward<TArgs>(args) ...);
+        else if constexpr (injectionArity<TImpl>() > 0)
+            impl.dependencies = &injectedDependencies<TImpl>();
+
+        addImpl(interfaceId<TInterface>(), std::move(impl));
+    }
+
+    const std::shared_ptr<BindingTable>& table() const
+    {
+        return table_;
+    }
+
+    static const BindingsState& fromBindings(const Bindings&);
+    static BindingsState& fromBindings(Bindings&);
+
+    template <typename ... TBinds>
+    static const BindingsState& fromBindings(const StaticBindings<TBinds ...>&)
+    {
+        return fromBindings(StaticBindings<TBinds ...>::bindings());
+    }
+
+private:
+    struct ImplDomain {};
+
+    /// Calls f with the constructor arguments for TImpl.
+    /// These are either the bound arguments, or dependencies injected from the given scope.
+    template <typename TImpl, typename TArgsTuple, typename F>
+    static decltype(auto) construct(const void* args, ScopeState& scope, F&& f)
+    {
+        if constexpr (std::tuple_size_v<TArgsTuple> > 0)
+            return std::apply(std::forward<F>(f), *static_cast<const TArgsTuple*>(args));
+        else
+            return inject<TImpl>(scope, std::forward<F>(f), std::make_index_sequence<injectionArity<TImpl>()>{});
+    }
+
+    template <typename TImpl, typename F, std::size_t ... Is>
+    static decltype(auto) inject(ScopeState& scope, F&& f, std::index_sequence<Is ...>)
+    {
+        return std::forward<F>(f)(((void)Is, Injector<TImpl>{&scope}) ...);
+    }
+
+    template <typename TInterface, typename TImpl, typename TArgsTuple>
+    static std::shared_ptr<void> create(const void* args, ScopeState& scope, ScopeArena* arena)
+    {
+        return construct<TImpl, TArgsTuple>(args, scope, [arena](auto&& ... args) -> std::shared_ptr<TInterface> {
+            if (arena != nullptr)
+                return std::allocate_shared<TImpl>(ArenaAllocator<TImpl>{arena}, std::forward<decltype(args)>(args) ...);
+
+            return std::make_shared<TImpl>(std::forward<decltype(args)>(args) ...);
+        });
+    }
+
+    template <typename TInterface, typename TImpl, typename TArgsTuple>
+    static std::shared_ptr<void> createIsolated(const void* args, ScopeState& scope)
+    {
+        return construct<TImpl, TArgsTuple>(args, scope, [](auto&& ... args) -> std::shared_ptr<TInterface> {
+            return std::allocate_shared<TImpl>(CacheLineAllocator<TImpl>{}, std::forward<decltype(args)>(args) ...);
+        });
+    }
+
+    template <typename TInterface, typename TImpl, typename TArgsTuple>
+    static PooledObject createRaw(const void* args, ScopeState& scope)
+    {
+        std::allocator<TImpl> alloc;
+        TImpl* instance = alloc.allocate(1);
+
+        try
+        {
+            construct<TImpl, TArgsTuple>(args, scope, [instance](auto&& ... args) {
+                ::new (static_cast<void*>(instance)) TImpl(std::forward<decltype(args)>(args) ...);
+            });
+        }
+        catch (...)
+        {
+            alloc.deallocate(instance, 1);
+            throw;
+        }
+
+        return {instance, static_cast<TInterface*>(instance)};
+    }
+
+    template <typename TImpl>
+    static void resetRaw(void* instance)
+    {
+        PoolTraits<TImpl>::reset(*static_cast<TImpl*>(instance));
+    }
+
+    template <typename TImpl>
+    static void destroyRaw(void* instance)
+    {
+        // The dynamic type is known to be TImpl, so there's no need for a virtual destructor.
+        auto* p = static_cast<TImpl*>(instance);
+        std::destroy_at(p);
+        std::allocator<TImpl>{}.deallocate(p, 1);
+    }
+
+    template <typename TInterface, typename TImpl, typename TArgsTuple>
+    static constexpr PoolOps poolOps = {
+        &createRaw<TInterface, TImpl, TArgsTuple>,
+        &resetRaw<TImpl>,
+        &destroyRaw<TImpl>,
+        PoolTraits<TImpl>::capacity
+    };
+
+    void addImpl(TypeId interfaceType, ImplData impl);
+
+    // Copied on write, once shared with a scope.
+    std::shared_ptr<BindingTable> table_;
+};
+
+
+struct ThreadContext;
+
+/// Records that the current thread is constructing the service identified by key, for the guard's lifetime.
+/// If the same service is already under construction further up the call stack, there's a cycle.
+class ConstructionGuard
+{
+public:
+    ConstructionGuard(const void* key, const std::type_info& type);
+
+    ConstructionGuard(const ConstructionGuard&) = delete;
+    ConstructionGuard& operator=(const ConstructionGuard&) = delete;
+
+    ~ConstructionGuard();
+};
+
+/// Holds a cached instance, which is constructed by exactly one thread and then published once.
+/// Threads that request the instance while it is being constructed wait for the owner to finish.
+struct InstanceSlot
+{
+    /// Claims the slot for construction by the calling thread.
+    /// Returns false if the slot is ready or claimed by another thread.
+    bool tryClaim();
+
+    /// Blocks until the constructing thread publishes or abandons the slot.
+    /// Throws if the slot is claimed by the calling thread itself, or if waiting would close
+    /// a cycle of threads waiting on each other.
+    void waitWhileClaimed(const std::type_info& type);
+
+    void publish(std::shared_ptr<void> value);
+
+    /// Releases the claim after a failed construction, so a waiting thread can retry.
+    void abandon();
+
+    /// Takes the instance of a ready slot, which can then be claimed again to create a new one.
+    /// Must not run concurrently with other operations.
+    std::shared_ptr<void> take();
+
+    std::atomic<bool> ready{false};
+    std::atomic<ThreadContext*> owner{nullptr};
+    std::atomic<bool> hasWaiters{false};
+    std::shared_ptr<void> instance;
+
+    // Set by the constructing thread, before the slot is published.
+    const std::type_info* type = nullptr;
+    // Slots of the same scope that were resolved during construction. May contain duplicates.
+    std::vector<InstanceSlot*> dependencies;
+};
+
+
+/// Makes a scope the active one on the calling thread for the activation's lifetime, unless it already is.
+/// Instances are constructed with their owning scope active, so their own dependencies are resolved there as well.
+class ScopeActivation
+{
+public:
+    explicit ScopeActivation(ScopeState& scope);
+
+    ScopeActivation(const ScopeActivation&) = delete;
+    ScopeActivation& operator=(const ScopeActivation&) = delete;
+
+    ~ScopeActivation();
+
+private:
+    ScopeState* scope_;
+};
+
+
+/// The instances of tags::PerThread services that one thread has obtained from one scope.
+/// Its thread accesses it without locking. It is released by whichever ends first, the thread or the scope.
+struct PerThreadBlock
+{
+    explicit PerThreadBlock(std::uint64_t scopeId) :
+        scopeId{scopeId}
+    {}
+
+    /// Destroys the instances, unless already done.
+    void release();
+
+    bool isAlive();
+
+    const std::uint64_t scopeId;
+    SlotTable<std::shared_ptr<void>> instances;
+
+    // Serializes release by the thread and the scope.
+    std::mutex mtx;
+    bool alive = true;
+};
+
+struct PerThreadBlockRef
+{
+    std::uint64_t scopeId = 0;
+    PerThreadBlock* block = nullptr;
+};
+
+/// The shared instance a thread is constructing.
+struct ConstructingInstance
+{
+    ScopeState* scope = nullptr;
+    InstanceSlot* slot = nullptr;
+};
+
+
+/// Names the instances of a ServiceList.
+struct AllImpls {};
+
+/// Instances of all implementations bound to TInterface in a scope, in binding order.
+template <typename TInterface>
+struct ServiceListData
+{
+    std::vector<TInterface*> items;
+    std::vector<std::shared_ptr<void>> instances;
+};
+
+
+class ScopeState
+{
+public:
+    /// Bindings are applied in order; later ones override earlier ones per interface.
+    /// Interfaces without bindings are resolved from the parent scope, if any.
+    ScopeState(ScopeState* parent, std::initializer_list<const BindingsState*> bindings, const ScopeOptions& options = {});
+
+    ScopeState(ScopeState* parent, std::shared_ptr<const BindingTable> bindings, const ScopeOptions& options = {});
+
+    /// Merges bindings in order, like the constructor does. The result may be null.
+    static std::shared_ptr<const BindingTable> mergeBindings(std::initializer_list<const BindingsState*> bindings);
+
+    ScopeState(const ScopeState&) = delete;
+    ScopeState& operator=(const ScopeState&) = delete;
+
+    ~ScopeState();
+
+    template <typename TInterface, typename Tag>
+    std::shared_ptr<TInterface> getService()
+    {
+        auto [owner, impl] = findImpl<TInterface>();
+
+        if constexpr (std::is_same_v<Tag, tags::Exclusive>)
+        {
+            // Create non-cached instance.
+            auto activation = ScopeActivation(*owner);
+            auto guard = ConstructionGuard(impl, typeid(TInterface));
+
+            if (ResolutionHooks* hooks = activeHooks())
+            {
+                auto start = std::chrono::steady_clock::now();
+                auto instance = impl->create(*owner);
+                hooks->exclusiveCreated(typeid(TInterface), std::chrono::steady_clock::now() - start);
+                return std::static_pointer_cast<TInterface>(std::move(instance));
+            }
+
+            return std::static_pointer_cast<TInterface>(impl->create(*owner));
+        }
+        else if constexpr (std::is_same_v<Tag, tags::Pooled>)
+        {
+            // Re-use an idle instance from the pool, which is shared like a regular instance.
+            const auto& pool = owner->sharedInstance(instanceId<TInterface, Tag>(), typeid(TInterface), [owner = owner, impl = impl] {
+                return std::make_shared<ObjectPool>(*impl, *owner, typeid(TInterface));
+            });
+
+            return static_cast<ObjectPool*>(pool.get())->acquire<TInterface>();
+        }
+        else if constexpr (std::is_same_v<Tag, tags::PerThread>)
+        {
+            return std::static_pointer_cast<TInterface>(owner->template perThreadInstance<TInterface>(*impl));
+        }
+        else if constexpr (ShardCount<Tag>::sharded)
+        {
+            const auto& shards = owner->template shardSet<TInterface, Tag>(*impl);
+            return std::static_pointer_cast<TInterface>(static_cast<ShardSet*>(shards.get())->local());
+        }
+        else
+        {
+            return std::static_pointer_cast<TInterface>(owner->template cachedInstance<TInterface, Tag>(*impl));
+        }
+    }
+
+    /// Returns instances of all implementations of TInterface, bound by the closest scope that binds it.
+    template <typename TInterface>
+    std::shared_ptr<const ServiceListData<TInterface>> getServiceList()
+    {
+        auto [owner, impl] = findImpl<TInterface>();
+        return std::static_pointer_cast<const ServiceListData<TInterface>>(owner->template serviceList<TInterface>());
+    }
+
+    /// Returns all instances of a sharded service.
+    template <typename TInterface, typename Tag>
+    std::shared_ptr<ShardSet> getShards()
+    {
+        static_assert(ShardCount<Tag>::sharded, "only sharded services have shards");
+
+        auto [owner, impl] = findImpl<TInterface>();
+        return std::static_pointer_cast<ShardSet>(owner->template shardSet<TInterface, Tag>(*impl));
+    }
+
+    /// A cached instance and the scope that owns it, which keeps it alive.
+    template <typename TInterface>
+    struct BorrowedInstance
+    {
+        TInterface* ptr;
+        ScopeState* owner;
+    };
+
+    /// Like getService, but does not share ownership of the instance.
+    /// Only applies to cached instances.
+    template <typename TInterface, typename Tag>
+    BorrowedInstance<TInterface> borrowService()
+    {
+        static_assert(!std::is_same_v<Tag, tags::Exclusive> && !std::is_same_v<Tag, tags::Pooled>,
+            "only cached instances can be borrowed");
+
+        auto [owner, impl] = findImpl<TInterface>();
+
+        if constexpr (std::is_same_v<Tag, tags::PerThread>)
+        {
+            const auto& instance = owner->template perThreadInstance<TInterface>(*impl);
+            return {static_cast<TInterface*>(instance.get()), owner};
+        }
+        else if constexpr (ShardCount<Tag>::sharded)
+        {
+            const auto& shards = owner->template shardSet<TInterface, Tag>(*impl);
+            return {static_cast<TInterface*>(static_cast<ShardSet*>(shards.get())->local().get()), owner};
+        }
+        else
+        {
+            const auto& instance = owner->template cachedInstance<TInterface, Tag>(*impl);
+            return {static_cast<TInterface*>(instance.get()), owner};
+        }
+    }
+
+    /// Creates the instance shared under tags::Shared for a binding of this scope, unless it already exists.
+    void instantiate(const ImplData& impl)
+    {
+        sharedInstance(impl.sharedInstanceType, *impl.interfaceType, [this, &impl] {
+            return impl.create(*this, arena_ ? &*arena_ : nullptr);
+        });
+    }
+
+    /// Returns the bindings of this scope, excluding those of its parents. May be null.
+    const BindingTable* bindings() const
+    {
+        return bindings_.get();
+    }
+
+    /// Checks the bindings visible from this scope for missing dependencies and cycles.
+    ValidationReport validate(const ValidationOptions& options);
+
+    /// Takes the slots of the shared instances created so far, in order of construction.
+    /// The scope forgets them, so each slot is taken once until its instance is created again.
+    std::vector<InstanceSlot*> takeConstructed();
+
+    /// Identifies this scope. Unlike its address, it is never re-used. Assigned on first use.
+    std::uint64_t id();
+
+    /// Releases all instances owned by this scope, as if it was destroyed, but keeps its tables and arena memory
+    /// for re-use. The scope then gets a new id. Must not run concurrently with other operations.
+    void reset();
+
+    /// Returns the allocations served by this scope's arena, if it has one.
+    ArenaStats arenaStats() const;
+
+#if DI_CHECK_BORROWED_REFS
+    void addBorrowedRef() { borrowedRefs_.fetch_add(1, std::memory_order_relaxed); }
+
+    void removeBorrowedRef() { borrowedRefs_.fetch_sub(1, std::memory_order_relaxed); }
+#endif
+
+    static const ScopeState& fromScope(const Scope&);
+    static ScopeState& fromScope(Scope&);
+
+private:
+    /// Returns the closest scope that binds TInterface, starting at this one, and its implementation.
+    template <typename TInterface>
+    std::pair<ScopeState*, const ImplData*> findImpl()
+    {
+        auto result = lookupImpl(interfaceId<TInterface>());
+        if (result.second == nullptr)
+            throw std::runtime_error("service interface is not bound");
+
+        return result;
+    }
+
+    std::pair<ScopeState*, const ImplData*> lookupImpl(TypeId interfaceType)
+    {
+        // Binding tables are immutable, so they can be read without locking.
+        for (ScopeState* scope = this; scope != nullptr; scope = scope->parent_)
+            if (scope->bindings_)
+                if (const ImplData* impl = scope->bindings_->find(interfaceType))
+                    return {scope, impl};
+
+        return {nullptr, nullptr};
+    }
+
+    bool hasInstance(TypeId instanceType) const
+    {
+        const InstanceSlot* slot = serviceInstances_.find(instanceType);
+        return slot != nullptr && slot->ready.load(std::memory_order_acquire);
+    }
+
+    template <typename TInterface, typename Tag>
+    const std::shared_ptr<void>& cachedInstance(const ImplData& impl)
+    {
+        return sharedInstance(instanceId<TInterface, Tag>(), typeid(TInterface), [this, &impl] {
+            return impl.create(*this, arena_ ? &*arena_ : nullptr);
+        });
+    }
+
+    /// Returns the instance cached under instanceType, creating it first if needed.
+    template <typename TCreate>
+    const std::shared_ptr<void>& sharedInstance(TypeId instanceType, const std::type_info& type, TCreate&& create)
+    {
+        // Check for tagged instance (lock-free).
+        if (auto* slot = serviceInstances_.find(instanceType); slot && slot->ready.load(std::memory_order_acquire))
+        {
+            if (ResolutionHooks* hooks = activeHooks())
+                hooks->cacheHit(type);
+
+            recordDependency(*slot);
+            return slot->instance;
+        }
+
+        ResolutionHooks* hooks = activeHooks();
+        if (hooks)
+            hooks->cacheMiss(type);
+
+        InstanceSlot& slot = instanceSlot(instanceType);
+
+        // Create instance exactly once. Concurrent requests wait for it, or take over if construction fails.
+        while (!slot.ready.load(std::memory_order_acquire))
+        {
+            if (!slot.tryClaim())
+            {
+                slot.waitWhileClaimed(type);
+                continue;
+            }
+
+            ConstructingInstance outer = constructing_;
+            constructing_ = {this, &slot};
+
+            std::chrono::steady_clock::time_point start;
+            if (hooks)
+            {
+                hooks->constructionStart(type);
+                start = std::chrono::steady_clock::now();
+            }
+
+            try
+            {
+                auto activation = ScopeActivation(*this);
+                auto guard = ConstructionGuard(&slot, type);
+                auto instance = create();
+
+                constructing_ = outer;
+                slot.type = &type;
+                slot.publish(std::move(instance));
+            }
+            catch (...)
+            {
+                constructing_ = outer;
+                slot.dependencies.clear();
+                slot.abandon();
+
+                if (hooks)
+                    hooks->constructionEnd(type, std::chrono::steady_clock::now() - start, true);
+
+                throw;
+            }
+
+            if (hooks)
+                hooks->constructionEnd(type, std::chrono::steady_clock::now() - start, false);
+
+            // Dependencies complete their construction first, so this order can be reversed for teardown.
+            std::lock_guard<std::mutex> lock(mtx_);
+            constructed_.push_back(&slot);
+        }
+
+        recordDependency(slot);
+        return slot.instance;
+    }
+
+    void recordDependency(InstanceSlot& slot)
+    {
+        // Instances of another scope outlive this one anyway.
+        if (constructing_.scope == this && constructing_.slot != &slot)
+            constructing_.slot->dependencies.push_back(&slot);
+    }
+
+    template <typename TInterface>
+    const std::shared_ptr<void>& serviceList()
+    {
+        return sharedInstance(instanceId<TInterface, AllImpls>(), typeid(TInterface), [this] {
+            const auto& impls = bindings_->impls[interfaceId<TInterface>()];
+
+            auto list = std::make_shared<ServiceListData<TInterface>>();
+            list->items.reserve(impls.size());
+            list->instances.reserve(impls.size());
+
+            for (std::size_t i = 0; i + 1 < impls.size(); ++i)
+                list->instances.push_back(impls[i].create(*this, arena_ ? &*arena_ : nullptr));
+
+            // The last implementation is the one ServiceRef obtains, so its instance is shared with it.
+            list->instances.push_back(cachedInstance<TInterface, tags::Shared>(impls.back()));
+
+            for (const auto& instance : list->instances)
+                list->items.push_back(static_cast<TInterface*>(instance.get()));
+
+            return list;
+        });
+    }
+
+    template <typename TInterface, typename Tag>
+    const std::shared_ptr<void>& shardSet(const ImplData& impl)
+    {
+        return sharedInstance(instanceId<TInterface, Tag>(), typeid(TInterface), [this, &impl] {
+            return std::make_shared<ShardSet>(impl, *this, ShardCount<Tag>::get());
+        });
+    }
+
+    /// Returns the calling thread's instance of TInterface, creating it first if needed.
+    template <typename TInterface>
+    const std::shared_ptr<void>& perThreadInstance(const ImplData& impl)
+    {
+        std::uint64_t id = id_.load(std::memory_order_relaxed);
+        PerThreadBlock* block = id != 0 && lastPerThreadBlock_.scopeId == id ? lastPerThreadBlock_.block : &perThreadBlock();
+
+        std::shared_ptr<void>& instance = block->instances.get(instanceId<TInterface, tags::PerThread>());
+        ResolutionHooks* hooks = activeHooks();
+
+        if (instance)
+        {
+            if (hooks)
+                hooks->cacheHit(typeid(TInterface));
+
+            return instance;
+        }
+
+        auto activation = ScopeActivation(*this);
+        auto guard = ConstructionGuard(&instance, typeid(TInterface));
+
+        if (!hooks)
+        {
+            instance = impl.create(*this, arena_ ? &*arena_ : nullptr);
+            return instance;
+        }
+
+        hooks->cacheMiss(typeid(TInterface));
+        hooks->constructionStart(typeid(TInterface));
+        auto start = std::chrono::steady_clock::now();
+
+        try
+        {
+            instance = impl.create(*this, arena_ ? &*arena_ : nullptr);
+        }
+        catch (...)
+        {
+            hooks->constructionEnd(typeid(TInterface), std::chrono::steady_clock::now() - start, true);
+            throw;
+        }
+
+        hooks->constructionEnd(typeid(TInterface), std::chrono::steady_clock::now() - start, false);
+        return instance;
+    }
+
+    /// Returns the calling thread's block of this scope, creating it first if needed.
+    PerThreadBlock& perThreadBlock();
+
+    /// Releases per-thread instances, then shared instances in reverse order of construction.
+    void releaseInstances();
+
+    InstanceSlot& instanceSlot(TypeId instanceType);
+
+    // Serializes allocation of instance slots.
+    std::mutex mtx_;
+
+    // Declared before the instances, so it outlives them.
+    std::optional<ScopeArena> arena_;
+
+    // InstanceId -> instance
+    SlotTable<InstanceSlot> serviceInstances_;
+
+    // See id(). Zero until assigned.
+    std::atomic<std::uint64_t> id_{0};
+    // Guarded by mtx_.
+    std::vector<std::shared_ptr<PerThreadBlock>> perThreadBlocks_;
+    // Slots of created shared instances, in order of construction. Guarded by mtx_.
+    std::vector<InstanceSlot*> constructed_;
+    // Swapped with perThreadBlocks_ and constructed_ while releasing instances, so both keep their capacity.
+    std::vector<std::shared_ptr<PerThreadBlock>> releasingBlocks_;
+    std::vector<InstanceSlot*> releasingSlots_;
+
+    // The block last used by the calling thread.
+    static inline thread_local PerThreadBlockRef lastPerThreadBlock_;
+    // The shared instance the calling thread is constructing, if any.
+    static inline thread_local ConstructingInstance constructing_;
+
+    std::shared_ptr<const BindingTable> bindings_;
+    ScopeState* parent_;
+
+#if DI_CHECK_BORROWED_REFS
+    std::atomic<std::size_t> borrowedRefs_{0};
+#endif
+};
+
+
+/// Each thread has its own stack of active scopes.
+/// The first scope pushed onto an empty stack, while there is none yet, becomes the process root.
+/// Threads without active scopes of their own resolve services from the root.
+class ScopeStack
+{
+public:
+    static void push(ScopeState& scope);
+
+    static void pop(ScopeState& scope);
+
+    static ScopeState& top()
+    {
+        if (ScopeState* scope = top_)
+            return *scope;
+
+        return root();
+    }
+
+    /// Returns the scope top() would return, or nullptr if there is none.
+    static ScopeState* tryTop()
+    {
+        if (ScopeState* scope = top_)
+            return scope;
+
+        return root_.load(std::memory_order_acquire);
+    }
+
+private:
+    static ScopeState& root();
+
+    static inline thread_local ScopeState* top_ = nullptr;
+    static inline std::atomic<ScopeState*> root_{nullptr};
+};
+
+
+/// The scopes of a coroutine (see ScopeAwarePromise).
+/// While it runs, they are on top of the running thread's stack. While it is suspended, they are kept here.
+class CoroutineScopes
+{
+public:
+    /// Captures the active scope of the calling thread as outermost scope.
+    CoroutineScopes();
+
+    /// Takes the coroutine's scopes off the running thread's stack.
+    void suspend();
+
+    /// Puts the coroutine's scopes on the running thread's stack, if it was suspended.
+    void resume();
+
+private:
+    ScopeState* outer_;
+    // Scopes created by the coroutine while it was suspended, outermost first.
+    std::vector<ScopeState*> inner_;
+    // Depth of the running thread's stack below the coroutine's scopes.
+    std::size_t base_;
+    bool outerPushed_ = false;
+    bool suspended_ = false;
+};
+
+
+class ScopeGuard
+{
+public:
+    explicit ScopeGuard(ScopeState& scope);
+
+    ~ScopeGuard();
+
+private:
+    ScopeState* scope_;
+};
+
+
+/// Counts the tasks of a wave handed to an executor, and collects their first error.
+class TaskGroup
+{
+public:
+    TaskGroup() = default;
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    /// Must be called before a task is handed to the executor.
+    void addTask();
+
+    /// Revokes a task that could not be handed to the executor.
+    void removeTask();
+
+    /// Waits until all tasks have run, then rethrows the first error, if any.
+    void wait();
+
+    /// Waits until all tasks have run, ignoring errors.
+    void drain() noexcept;
+
+protected:
+    /// Called by each task once it has run.
+    void finishTask(std::exception_ptr error) noexcept;
+
+private:
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::size_t pendingTasks_ = 0;
+    std::exception_ptr error_;
+};
+
+
+/// Eagerly creates the shared instances bound by a scope.
+/// Instances are grouped into waves, so that each only depends on instances of earlier waves.
+/// Dependencies are known for constructor-injected implementations; others are assumed to have none.
+/// That is only a matter of parallelism, since concurrent requests for an instance wait for its construction.
+class WarmUp : public TaskGroup
+{
+public:
+    explicit WarmUp(ScopeState& scope);
+
+    const std::vector<std::vector<const ImplData*>>& waves() const
+    {
+        return waves_;
+    }
+
+    /// Creates the instance for impl. Errors are reported by wait().
+    void run(const ImplData* impl) noexcept;
+
+private:
+    ScopeState& scope_;
+    std::vector<std::vector<const ImplData*>> waves_;
+};
+
+
+/// Releases the shared instances created by a scope.
+/// Instances are grouped into waves, so that each is only a dependency of instances in earlier waves.
+/// Dependencies are those resolved while an instance was constructed; its construction order breaks ties.
+class Teardown : public TaskGroup
+{
+public:
+    explicit Teardown(ScopeState& scope);
+
+    const std::vector<std::vector<std::size_t>>& waves() const
+    {
+        return waves_;
+    }
+
+    /// Releases the scope's reference to the instance of a node.
+    void run(std::size_t node) noexcept;
+
+    /// Lists the released instances, in order of waves.
+    ShutdownReport report() const;
+
+private:
+    std::vector<InstanceSlot*> nodes_;
+    std::vector<std::vector<std::size_t>> waves_;
+
+    // Indexed by node. Each is written by the task that releases it.
+    std::vector<ShutdownReport::Service> services_;
+};
+
+
+/// Hands each item of a wave as a task to the executor, and waits for them before starting the next wave.
+template <typename TWaves, typename TExecutor>
+void runWaves(TWaves& waves, TExecutor& executor)
+{
+    for (const auto& wave : waves.waves())
+    {
+        for (auto item : wave)
+        {
+            waves.addTask();
+
+            try
+            {
+                executor([&waves, item] { waves.run(item); });
+            }
+            catch (...)
+            {
+                waves.removeTask();
+                waves.drain();
+                throw;
+            }
+        }
+
+        waves.wait();
+    }
+}
+
+
+template <typename TInterface, typename Tag>
+std::shared_ptr<TInterface> getService()
+{
+    auto& scope = ScopeStack::top();
+    return scope.getService<TInterface, Tag>();
+}
+
+template <typename TInterface, typename Tag>
+ScopeState::BorrowedInstance<TInterface> borrowService()
+{
+    auto& scope = ScopeStack::top();
+    return scope.borrowService<TInterface, Tag>();
+}
+
+} // namespace di::detail
+
+
+namespace di {
+
+/// Bindings define which implementation and arguments to use when instantiating an interface.
+///
+/// An interface can be bound to several implementations, which are kept in binding order.
+/// ServiceRef uses the last one; ServiceList uses all of them. Binding the same implementation to an interface
+/// twice throws a runtime error.
+class Bindings
+{
+public:
+    template <typename TInterface, typename TImpl, typename ... TArgs>
+    Bindings& service(TArgs&& ... args)
+    {
+        state_.setService<TInterface, TImpl>(std::forward<TArgs>(args) ...);
+        return *this;
+    }
+
+private:
+    detail::BindingsState state_;
+
+    friend class detail::BindingsState;
+};
+
+
+/// Binds TInterface to TImpl in StaticBindings.
+template <typename TInterface, typename TImpl>
+struct Bind
+{
+    using Interface = TInterface;
+    using Impl = TImpl;
+};
+
+namespace detail {
+
+template <typename T>
+constexpr bool isBindings = std::is_same_v<T, Bindings>;
+
+template <typename ... TBinds>
+constexpr bool isBindings<StaticBindings<TBinds ...>> = true;
+
+template <typename TInterface, typename ... TInterfaces>
+constexpr std::size_t countOf = (std::size_t{std::is_same_v<TInterface, TInterfaces>} + ... + 0);
+
+template <typename TInterface, typename ... TInterfaces>
+constexpr std::size_t indexOf()
+{
+    constexpr bool matches[] = {std::is_same_v<TInterface, TInterfaces> ..., false};
+
+    std::size_t i = 0;
+    while (i < sizeof ... (TInterfaces) && !matches[i])
+        ++i;
+
+    return i;
+}
+
+template <typename TBind>
+constexpr bool isValidBind = std::is_base_of_v<typename TBind::Interface, typename TBind::Impl>
+    && (std::is_default_constructible_v<typename TBind::Impl> || injectionArity<typename TBind::Impl>() > 0);
+
+} // namespace detail
+
+/// Bindings that are fixed at compile time, given as a list of Bind<TInterface, TImpl>.
+/// They are used with Scope and ServiceRef like regular Bindings.
+///
+/// The list is checked when compiled: each interface is bound at most once, to an implementation that
+/// derives from it and is either default constructible or constructor-injected. Arguments are not supported.
+/// The binding table is built once per distinct list, on first use, and shared by all scopes using it.
+template <typename ... TBinds>
+class StaticBindings
+{
+    static_assert(((detail::countOf<typename TBinds::Interface, typename TBinds::Interface ...> == 1) && ...),
+        "an interface is bound more than once");
+
+    static_assert((detail::isValidBind<TBinds> && ...),
+        "an implementation does not derive from its interface, or cannot be constructed without arguments");
+
+public:
+    template <typename TInterface>
+    static constexpr bool binds = detail::countOf<TInterface, typename TBinds::Interface ...> > 0;
+
+    /// The implementation bound to TInterface.
+    template <typename TInterface>
+    using ImplOf = typename std::tuple_element_t<detail::indexOf<TInterface, typename TBinds::Interface ...>(), std::tuple<TBinds ...>>::Impl;
+
+    static const Bindings& bindings()
+    {
+        static const Bindings instance = [] {
+            Bindings result;
+            (result.service<typename TBinds::Interface, typename TBinds::Impl>(), ...);
+            return result;
+        }();
+
+        return instance;
+    }
+};
+
+
+/// Scope selects the bindings to be used in the current execution scope.
+///
+/// For the duration of its lifetime, the Scope instance is added to the calling thread's stack of active scopes.
+/// Scopes must be destroyed in the inverse order of their creation, otherwise a runtime error is thrown.
+///
+/// The first Scope created on a thread without active scopes becomes the process root, unless there already is one.
+/// Threads that have no active scopes of their own resolve services from the root.
+///
+/// If several of the given bindings bind the same interface, the last of them overrides the others
+/// for that interface, including all of its implementations.
+///
+/// Interfaces that are not bound by any of the given bindings are resolved from the enclosing scope,
+/// i.e. the one that was active when this scope was created. The enclosing scope must outlive this scope.
+/// Creating a scope does not copy the bindings, it shares their (immutable) binding table.
+class Scope
+{
+public:
+    template <typename ... TBindings, std::enable_if_t<(detail::isBindings<TBindings> && ...), int> = 0>
+    explicit Scope(const TBindings& ... bindings) :
+        Scope(ScopeOptions{}, bindings ...)
+    {}
+
+    template <typename ... TBindings>
+    explicit Scope(const ScopeOptions& options, const TBindings& ... bindings) :
+        state_{detail::ScopeStack::tryTop(), {&detail::BindingsState::fromBindings(bindings) ...}, options},
+        guard_{state_}
+    {}
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+    Scope(Scope&&) = delete;
+    Scope& operator=(Scope&&) = delete;
+
+    /// Checks that the dependencies of all bindings visible from this scope are bound, and free of cycles.
+    /// Only constructor-injected dependencies are known without creating instances.
+    ///
+    /// Optionally, the shared instances bound by this scope are created as well, in dependency order.
+    /// This also reports errors thrown by constructors, e.g. for dependencies that are not declared.
+    ValidationReport validate(const ValidationOptions& options = {});
+
+    /// Eagerly creates the shared instances bound by this scope, rather than on first reference.
+    ///
+    /// Instances are created in waves of independent services, each of which is run concurrently on the executor.
+    /// The executor is called with a callable task, which it must run exactly once on any thread.
+    /// Dependencies between instances are known for constructor-injected implementations (see Bindings);
+    /// others may be created concurrently with their dependencies, which then wait for each other.
+    ///
+    /// Blocks until all instances are created. If any construction fails, the first error is rethrown after
+    /// the current wave.
+    template <typename TExecutor>
+    void warmUp(TExecutor&& executor)
+    {
+        detail::WarmUp warmUp{state_};
+        detail::runWaves(warmUp, executor);
+    }
+
+    /// Releases the shared instances of this scope in reverse dependency order, rather than when it is destroyed.
+    ///
+    /// An instance is released after all instances that resolved it during their construction, so it may
+    /// still be used by their destructors. Independent instances are released concurrently on the executor,
+    /// in waves, like in warmUp(). Instances still referenced outside the scope are destroyed by their last reference.
+    ///
+    /// Blocks until all instances are released. The scope remains usable, and creates instances again on demand.
+    /// Services must not be resolved from it concurrently with shutdown.
+    template <typename TExecutor>
+    ShutdownReport shutdown(TExecutor&& executor)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        detail::Teardown teardown{state_};
+        detail::runWaves(teardown, executor);
+
+        ShutdownReport report = teardown.report();
+        report.totalTime = std::chrono::steady_clock::now() - start;
+        return report;
+    }
+
+    /// Releases the shared instances of this scope one after another, on the calling thread.
+    ShutdownReport shutdown();
+
+    /// Releases all instances of this scope, as when it is destroyed, but keeps its tables and arena memory.
+    /// The scope remains active, and creates instances again on demand. Captured contexts of it are invalidated.
+    /// Services must not be resolved from it concurrently with reset.
+    void reset();
+
+    /// Returns the allocations served by the scope's arena (see ScopeOptions::arenaBlockSize).
+    ArenaStats arenaStats() const;
+
+private:
+    detail::ScopeState state_;
+    detail::ScopeGuard guard_;
+
+    friend class detail::ScopeState;
+};
+
+
+class PooledScope;
+
+/// A ScopePool hands out scopes with the same bindings, e.g. one per request, and recycles them once released.
+///
+/// A recycled scope is reset (see Scope::reset), so it keeps its tables and arena memory. Once the pool holds
+/// as many scopes as are used at a time, acquiring and releasing them does not allocate.
+///
+/// Pooled scopes resolve unbound interfaces from the scope that was active when the pool was created,
+/// which must outlive the pool. The pool must outlive the scopes it handed out.
+class ScopePool
+{
+public:
+    template <typename ... TBindings, std::enable_if_t<(detail::isBindings<TBindings> && ...), int> = 0>
+    explicit ScopePool(const TBindings& ... bindings) :
+        ScopePool(ScopeOptions{}, bindings ...)
+    {}
+
+    template <typename ... TBindings>
+    explicit ScopePool(const ScopeOptions& options, const TBindings& ... bindings) :
+        parent_{detail::ScopeStack::tryTop()},
+        bindings_{detail::ScopeState::mergeBindings({&detail::BindingsState::fromBindings(bindings) ...})},
+        options_{options}
+    {}
+
+    ScopePool(const ScopePool&) = delete;
+    ScopePool& operator=(const ScopePool&) = delete;
+
+    /// Returns an idle scope, or a new one if there is none, as the active scope of the calling thread.
+    PooledScope acquire();
+
+    /// Number of scopes waiting to be acquired again.
+    std::size_t idleCount() const;
+
+private:
+    void recycle(std::unique_ptr<detail::ScopeState> state) noexcept;
+
+    detail::ScopeState* parent_;
+    std::shared_ptr<const detail::BindingTable> bindings_;
+    ScopeOptions options_;
+
+    mutable std::mutex mtx_;
+    std::vector<std::unique_ptr<detail::ScopeState>> idle_;
+
+    friend class PooledScope;
+};
+
+
+/// A scope acquired from a ScopePool. It behaves like a Scope, except that it returns to the pool when destroyed.
+class PooledScope
+{
+public:
+    PooledScope(const PooledScope&) = delete;
+    PooledScope& operator=(const PooledScope&) = delete;
+
+    PooledScope(PooledScope&&) = delete;
+    PooledScope& operator=(PooledScope&&) = delete;
+
+    ~PooledScope();
+
+    /// Returns the allocations served by the scope's arena since it was acquired.
+    ArenaStats arenaStats() const;
+
+private:
+    PooledScope(ScopePool& pool, std::unique_ptr<detail::ScopeState> state);
+
+    ScopePool& pool_;
+    std::unique_ptr<detail::ScopeState> state_;
+
+    friend class ScopePool;
+};
+
+
+/// A ScopeContext captures the active scope of a thread, to make it active on other threads, e.g. in tasks run by
+/// a thread pool. ServiceRefs in those tasks then resolve services from the captured scope.
+///
+/// The captured scope must outlive the context. Activating a context of a destroyed scope throws a runtime error,
+/// as long as its memory has not been re-used by anything else than another scope. If DI_CHECK_BORROWED_REFS is enabled,
+/// scopes abort when destroyed while they are still captured.
+class ScopeContext
+{
+public:
+    /// Captures the active scope of the calling thread.
+    static ScopeContext capture();
+
+    ScopeContext(const ScopeContext& other);
+    ScopeContext& operator=(const ScopeContext& other);
+
+    ~ScopeContext();
+
+    /// Runs f with the captured scope active on the calling thread.
+    template <typename F>
+    decltype(auto) run(F&& f) const
+    {
+        auto activation = detail::ScopeActivation(scope());
+        return std::forward<F>(f)();
+    }
+
+    /// Returns a callable that runs f with the captured scope active, on whichever thread calls it.
+    template <typename F>
+    auto wrap(F&& f) const
+    {
+        return [context = *this, f = std::forward<F>(f)](auto&& ... args) mutable -> decltype(auto) {
+            auto activation = detail::ScopeActivation(context.scope());
+            return f(std::forward<decltype(args)>(args) ...);
+        };
+    }
+
+private:
+    explicit ScopeContext(detail::ScopeState& scope);
+
+    detail::ScopeState& scope() const;
+
+    detail::ScopeState* scope_;
+    std::uint64_t id_;
+};
+
+
+/// A ServiceRef obtains a service instance of the given interface type.
+///
+/// The bindings of the top-most active scope are used to select an implementation.
+/// If no implementation is bound, a runtime error is thrown.
+///
+/// Depending on the Tag template parameter, the instance may be cached and shared within
+/// the active scope.
+///
+/// If tagged with tags::Exclusive, a new instance is created exclusively for this ServiceRef.
+///
+/// If tagged with tags::Pooled, the instance is exclusive to this ServiceRef (and its copies) as well,
+/// but it is recycled once released, rather than destroyed. See PoolTraits to customize recycling.
+/// Pooled instances must be released before their scope is destroyed.
+///
+/// If tagged with tags::PerThread, each thread obtains its own instance from the scope, which it accesses without locking.
+/// Per-thread instances are destroyed when either their thread or their scope ends.
+///
+/// If tagged with tags::Sharded<N>, N instances are shared, and each ServiceRef obtains the one for the CPU its thread
+/// runs on at the time. tags::PerCpu creates one per CPU. Threads may still migrate between CPUs, or share one, so
+/// sharded instances must be thread-safe as well; sharding only avoids contention. See ServiceShards to aggregate them.
+///
+/// Otherwise, the tag type denotes the name under which the instance is shared.
+/// A shared instance is created on first reference, then cached and re-used on further ones.
+/// Once created, it remains cached until its active scope is destroyed.
+/// By default, ServiceRefs are shared under the name tags::Shared; user-defined tags can be used as well.
+/// Dependencies between shared instances must not result in cycles, otherwise a runtime error is thrown.
+template <typename TInterface, typename Tag = tags::Shared>
+class ServiceRef
+{
+public:
+    ServiceRef() :
+        ptr_{detail::getService<TInterface, Tag>()}
+    {}
+
+    ServiceRef(const ServiceRef&) = default;
+    ServiceRef& operator=(const ServiceRef&) = default;
+
+    ServiceRef(ServiceRef&&) = default;
+    ServiceRef& operator=(ServiceRef&&) = default;
+
+    const TInterface& operator*() const { return ptr_.operator*(); }
+
+    TInterface& operator*() { return ptr_.operator*(); }
+
+    const TInterface* operator->() const { return ptr_.operator->(); }
+
+    TInterface* operator->() { return ptr_.operator->(); }
+
+    operator std::shared_ptr<TInterface>() const { return ptr_; }
+
+private:
+    explicit ServiceRef(std::shared_ptr<TInterface> ptr) :
+        ptr_{std::move(ptr)}
+    {}
+
+    std::shared_ptr<TInterface> ptr_;
+
+    template <typename>
+    friend struct detail::InjectedDependency;
+};
+
+
+/// A BorrowedServiceRef obtains a cached service instance like ServiceRef, but does not share its ownership.
+///
+/// Cached instances live as long as the scope that owns them, so ServiceRef's reference counting is only needed
+/// to keep them alive beyond it. A BorrowedServiceRef holds a raw pointer instead, which makes copying and destroying
+/// it free of atomic operations on the instance's shared control block.
+///
+/// A BorrowedServiceRef must not outlive the scope that owns its instance, nor the thread for tags::PerThread.
+/// If DI_CHECK_BORROWED_REFS is enabled, scopes abort when destroyed while they are still borrowed from.
+template <typename TInterface, typename Tag = tags::Shared>
+class BorrowedServiceRef
+{
+    static_assert(!std::is_same_v<Tag, tags::Exclusive> && !std::is_same_v<Tag, tags::Pooled>,
+        "only cached instances can be borrowed");
+
+public:
+    BorrowedServiceRef() :
+        BorrowedServiceRef(detail::borrowService<TInterface, Tag>())
+    {}
+
+#if DI_CHECK_BORROWED_REFS
+    BorrowedServiceRef(const BorrowedServiceRef& other) :
+        ptr_{other.ptr_},
+        owner_{other.owner_}
+    {
+        owner_->addBorrowedRef();
+    }
+
+    BorrowedServiceRef& operator=(const BorrowedServiceRef& other)
+    {
+        other.owner_->addBorrowedRef();
+        owner_->removeBorrowedRef();
+        ptr_ = other.ptr_;
+        owner_ = other.owner_;
+        return *this;
+    }
+
+    ~BorrowedServiceRef()
+    {
+        owner_->removeBorrowedRef();
+    }
+#endif
+
+    const TInterface& operator*() const { return *ptr_; }
+
+    TInterface& operator*() { return *ptr_; }
+
+    const TInterface* operator->() const { return ptr_; }
+
+    TInterface* operator->() { return ptr_; }
+
+private:
+    explicit BorrowedServiceRef(detail::ScopeState::BorrowedInstance<TInterface> instance) :
+        ptr_{instance.ptr}
+    {
+#if DI_CHECK_BORROWED_REFS
+        owner_ = instance.owner;
+        owner_->addBorrowedRef();
+#endif
+    }
+
+    TInterface* ptr_;
+#if DI_CHECK_BORROWED_REFS
+    detail::ScopeState* owner_;
+#endif
+
+    template <typename>
+    friend struct detail::InjectedDependency;
+};
+
+
+/// A LazyServiceRef obtains a service instance like ServiceRef, but only when it is first dereferenced.
+/// Services that are never used through it are not created.
+///
+/// The scope that is active when the LazyServiceRef is created is captured and used for resolution later on,
+/// regardless of the scopes active at that point. The LazyServiceRef must not outlive it; if DI_CHECK_BORROWED_REFS
+/// is enabled, scopes abort when destroyed while a LazyServiceRef still refers to them.
+///
+/// Dereferencing is thread-safe. Once resolved, it costs a single atomic load.
+template <typename TInterface, typename Tag = tags::Shared>
+class LazyServiceRef
+{
+public:
+    LazyServiceRef() :
+        LazyServiceRef(detail::ScopeStack::top())
+    {}
+
+    LazyServiceRef(const LazyServiceRef& other) :
+        scope_{other.scope_}
+    {
+        if (TInterface* ptr = other.ptr_.load(std::memory_order_acquire))
+        {
+            instance_ = other.instance_;
+            ptr_.store(ptr, std::memory_order_relaxed);
+        }
+
+#if DI_CHECK_BORROWED_REFS
+        scope_->addBorrowedRef();
+#endif
+    }
+
+    LazyServiceRef& operator=(const LazyServiceRef& other)
+    {
+        TInterface* ptr = other.ptr_.load(std::memory_order_acquire);
+        instance_ = ptr != nullptr ? other.instance_ : nullptr;
+        ptr_.store(ptr, std::memory_order_relaxed);
+
+#if DI_CHECK_BORROWED_REFS
+        other.scope_->addBorrowedRef();
+        scope_->removeBorrowedRef();
+#endif
+        scope_ = other.scope_;
+        return *this;
+    }
+
+    ~LazyServiceRef()
+    {
+#if DI_CHECK_BORROWED_REFS
+        scope_->removeBorrowedRef();
+#endif
+    }
+
+    const TInterface& operator*() const { return *get(); }
+
+    TInterface& operator*() { return *get(); }
+
+    const TInterface* operator->() const { return get(); }
+
+    TInterface* operator->() { return get(); }
+
+    operator std::shared_ptr<TInterface>() const
+    {
+        get();
+        return instance_;
+    }
+
+    bool isResolved() const
+    {
+        return ptr_.load(std::memory_order_acquire) != nullptr;
+    }
+
+private:
+    explicit LazyServiceRef(detail::ScopeState& scope) :
+        scope_{&scope}
+    {
+#if DI_CHECK_BORROWED_REFS
+        scope_->addBorrowedRef();
+#endif
+    }
+
+    TInterface* get() const
+    {
+        if (TInterface* ptr = ptr_.load(std::memory_order_acquire))
+            return ptr;
+
+        return resolve();
+    }
+
+    TInterface* resolve() const
+    {
+        // Concurrent first dereferences are rare, so losers just yield until the winner has published.
+        for (;;)
+        {
+            if (!resolving_.exchange(true, std::memory_order_acquire))
+            {
+                TInterface* ptr = ptr_.load(std::memory_order_relaxed);
+
+                if (ptr == nullptr)
+                {
+                    try
+                    {
+                        instance_ = scope_->getService<TInterface, Tag>();
+                    }
+                    catch (...)
+                    {
+                        resolving_.store(false, std::memory_order_release);
+                        throw;
+                    }
+
+                    ptr = instance_.get();
+                    ptr_.store(ptr, std::memory_order_release);
+                }
+
+                resolving_.store(false, std::memory_order_release);
+                return ptr;
+            }
+
+            std::this_thread::yield();
+
+            if (TInterface* ptr = ptr_.load(std::memory_order_acquire))
+                return ptr;
+        }
+    }
+
+    // Written once, before ptr_ is published.
+    mutable std::shared_ptr<TInterface> instance_;
+    mutable std::atomic<TInterface*> ptr_{nullptr};
+    mutable std::atomic<bool> resolving_{false};
+    detail::ScopeState* scope_;
+
+    template <typename>
+    friend struct detail::InjectedDependency;
+};
+
+
+/// A ServiceList obtains instances of all implementations bound to the given interface, in binding order.
+/// They are those of the closest scope that binds the interface; enclosing scopes don't add to them.
+///
+/// The list is created once per scope, on first reference, then cached like a shared instance and re-used.
+/// Each implementation is instantiated for the list, except the last one, whose instance is shared with ServiceRef.
+/// Instances are stored as a contiguous array of pointers, and iterated as such.
+template <typename TInterface>
+class ServiceList
+{
+public:
+    using const_iterator = TInterface* const*;
+
+    ServiceList() :
+        data_{detail::ScopeStack::top().getServiceList<TInterface>()}
+    {}
+
+    std::size_t size() const { return data_->items.size(); }
+
+    TInterface& operator[](std::size_t i) const { return *data_->items[i]; }
+
+    const_iterator begin() const { return data_->items.data(); }
+
+    const_iterator end() const { return data_->items.data() + data_->items.size(); }
+
+private:
+    explicit ServiceList(std::shared_ptr<const detail::ServiceListData<TInterface>> data) :
+        data_{std::move(data)}
+    {}
+
+    std::shared_ptr<const detail::ServiceListData<TInterface>> data_;
+
+    template <typename>
+    friend struct detail::InjectedDependency;
+};
+
+
+/// ServiceShards obtains all instances of a sharded service (see tags::Sharded and tags::PerCpu), e.g. to aggregate them.
+/// Like ServiceRef, it shares their ownership.
+template <typename TInterface, typename Tag = tags::PerCpu>
+class ServiceShards
+{
+public:
+    ServiceShards() :
+        shards_{detail::ScopeStack::top().getShards<TInterface, Tag>()}
+    {}
+
+    std::size_t size() const { return shards_->size(); }
+
+    TInterface& operator[](std::size_t i) const { return *static_cast<TInterface*>(shards_->at(i).get()); }
+
+    template <typename F>
+    void forEach(F&& f) const
+    {
+        for (std::size_t i = 0; i < shards_->size(); ++i)
+            f((*this)[i]);
+    }
+
+private:
+    std::shared_ptr<detail::ShardSet> shards_;
+};
+
+}// namespace di
+
+
+namespace di::detail {
+
+template <typename T>
+struct InjectedDependency
+{
+    static constexpr bool supported = false;
+};
+
+template <typename TInterface, typename Tag>
+struct InjectedDependency<ServiceRef<TInterface, Tag>>
+{
+    static constexpr bool supported = true;
+    static constexpr bool lazy = false;
+
+    using Interface = TInterface;
+    using DependencyTag = Tag;
+
+    static ServiceRef<TInterface, Tag> resolve(ScopeState& scope)
+    {
+        return ServiceRef<TInterface, Tag>{scope.getService<TInterface, Tag>()};
+    }
+};
+
+template <typename TInterface, typename Tag>
+struct InjectedDependency<BorrowedServiceRef<TInterface, Tag>>
+{
+    static constexpr bool supported = true;
+    static constexpr bool lazy = false;
+
+    using Interface = TInterface;
+    using DependencyTag = Tag;
+
+    static BorrowedServiceRef<TInterface, Tag> resolve(ScopeState& scope)
+    {
+        return BorrowedServiceRef<TInterface, Tag>{scope.borrowService<TInterface, Tag>()};
+    }
+};
+
+template <typename TInterface, typename Tag>
+struct InjectedDependency<LazyServiceRef<TInterface, Tag>>
+{
+    static constexpr bool supported = true;
+    static constexpr bool lazy = true;
+
+    using Interface = TInterface;
+    using DependencyTag = Tag;
+
+    static LazyServiceRef<TInterface, Tag> resolve(ScopeState& scope)
+    {
+        return LazyServiceRef<TInterface, Tag>{scope};
+    }
+};
+
+template <typename TInterface>
+struct InjectedDependency<ServiceList<TInterface>>
+{
+    static constexpr bool supported = true;
+    static constexpr bool lazy = false;
+
+    using Interface = TInterface;
+    using DependencyTag = AllImpls;
+
+    static ServiceList<TInterface> resolve(ScopeState& scope)
+    {
+        return ServiceList<TInterface>{scope.getServiceList<TInterface>()};
+    }
+};
+
+template <typename TInterface>
+struct InjectedDependency<std::shared_ptr<TInterface>>
+{
+    static constexpr bool supported = true;
+    static constexpr bool lazy = false;
+
+    using Interface = TInterface;
+    using DependencyTag = tags::Shared;
+
+    static std::shared_ptr<TInterface> resolve(ScopeState& scope)
+    {
+        return scope.getService<TInterface, tags::Shared>();
+    }
+};
+
+/// Stands in for each constructor parameter of TImpl, and converts to the dependency it asks for:
+/// ServiceRef, BorrowedServiceRef, LazyServiceRef, ServiceList or std::shared_ptr of an interface, or a reference to a shared instance.
+/// Dependencies are resolved from the scope that constructs TImpl, rather than the active scope of the thread.
+///
+/// Each conversion that is instantiated registers the dependency of TImpl (see injectedDependencies).
+template <typename TImpl>
+struct Injector
+{
+    template <typename T, std::enable_if_t<InjectedDependency<T>::supported, int> = 0>
+    operator T() const
+    {
+        using D = InjectedDependency<T>;
+        (void)DependencyRegistration<TImpl, typename D::Interface, typename D::DependencyTag, D::lazy>::registered;
+        return D::resolve(*scope);
+    }
+
+    template <typename T, std::enable_if_t<std::is_class_v<T> && !InjectedDependency<std::remove_cv_t<T>>::supported
+        && !std::is_same_v<std::remove_cv_t<T>, TImpl>, int> = 0>
+    operator T&() const
+    {
+        using TInterface = std::remove_cv_t<T>;
+        (void)DependencyRegistration<TImpl, TInterface, tags::Shared, false>::registered;
+        return *scope->borrowService<TInterface, tags::Shared>().ptr;
+    }
+
+    ScopeState* scope;
+};
+
+} // namespace di::detail
+
+
+#if DI_HAS_COROUTINES
+
+namespace di::detail {
+
+template <typename T>
+decltype(auto) getAwaiter(T&& awaitable)
+{
+    if constexpr (requires { std::forward<T>(awaitable).operator co_await(); })
+        return std::forward<T>(awaitable).operator co_await();
+    else if constexpr (requires { operator co_await(std::forward<T>(awaitable)); })
+        return operator co_await(std::forward<T>(awaitable));
+    else
+        return std::forward<T>(awaitable);
+}
+
+template <typename T>
+using AwaiterStorage = std::conditional_t<std::is_lvalue_reference_v<T>, T, std::remove_cvref_t<T>>;
+
+/// Wraps an awaiter to take the coroutine's scopes along when it suspends and resumes.
+template <typename TAwaiter, bool final>
+struct ScopedAwaiter
+{
+    bool await_ready() noexcept(final)
+    {
+        // The coroutine won't resume after its final suspension.
+        if constexpr (final)
+            scopes->suspend();
+
+        return awaiter.await_ready();
+    }
+
+    template <typename TPromise>
+    decltype(auto) await_suspend(std::coroutine_handle<TPromise> handle) noexcept(final)
+    {
+        if constexpr (final)
+        {
+            return awaiter.await_suspend(handle);
+        }
+        else
+        {
+            // Once handed to the awaiter, the coroutine may be resumed on another thread at any point.
+            scopes->suspend();
+
+            try
+            {
+                return awaiter.await_suspend(handle);
+            }
+            catch (...)
+            {
+                scopes->resume();
+                throw;
+            }
+        }
+    }
+
+    decltype(auto) await_resume() noexcept(final)
+    {
+        if constexpr (!final)
+            scopes->resume();
+
+        return awaiter.await_resume();
+    }
+
+    TAwaiter awaiter;
+    CoroutineScopes* scopes;
+};
+
+template <typename TAwaitable, bool final>
+using ScopedAwaiterFor = ScopedAwaiter<AwaiterStorage<decltype(getAwaiter(std::declval<TAwaitable>()))>, final>;
+
+} // namespace di::detail
+
+
+namespace di {
+
+/// Base class for promise types of coroutines that resolve services, or create scopes.
+///
+/// A coroutine may be resumed on a different thread after each co_await, while scopes are active per thread.
+/// This takes the scopes of the coroutine along: the scope that was active when it was created,
+/// and any scopes it created itself. They are taken off the thread's stack when the coroutine suspends,
+/// and put on top of the resuming thread's stack when it resumes. The cost is proportional to the number of
+/// scopes the coroutine created itself, usually none or one.
+///
+/// All co_await expressions are transformed accordingly. Derived promise types that define initial_suspend or
+/// final_suspend themselves must wrap the returned awaitables with scoped() and scopedFinal(), respectively.
+/// A coroutine must not be destroyed while it is suspended with scopes of its own.
+class ScopeAwarePromise
+{
+public:
+    template <typename TAwaitable>
+    detail::ScopedAwaiterFor<TAwaitable, false> await_transform(TAwaitable&& awaitable)
+    {
+        return scoped(std::forward<TAwaitable>(awaitable));
+    }
+
+    detail::ScopedAwaiter<std::suspend_never, false> initial_suspend()
+    {
+        return scoped(std::suspend_never{});
+    }
+
+    detail::ScopedAwaiter<std::suspend_always, true> final_suspend() noexcept
+    {
+        return scopedFinal(std::suspend_always{});
+    }
+
+protected:
+    template <typename TAwaitable>
+    detail::ScopedAwaiterFor<TAwaitable, false> scoped(TAwaitable&& awaitable)
+    {
+        return {detail::getAwaiter(std::forward<TAwaitable>(awaitable)), &scopes_};
+    }
+
+    template <typename TAwaitable>
+    detail::ScopedAwaiterFor<TAwaitable, true> scopedFinal(TAwaitable&& awaitable) noexcept
+    {
+        return {detail::getAwaiter(std::forward<TAwaitable>(awaitable)), &scopes_};
+    }
+
+private:
+    detail::CoroutineScopes scopes_;
+};
+
+} // namespace di
+
+#endif // DI_HAS_COROUTINES
@@ -0,0 +1,98 @@
+#include "di.h"
+
+#include <iostream>
+#include <string>
+
+struct Codec
+{
+    virtual ~Codec() = default;
+    virtual std::string name() const = 0;
+};
+
+struct SlowCodec : Codec
+{
+    std::string name() const override { return "slow"; }
+};
+
+struct FastCodec : Codec
+{
+    std::string name() const override { return "fast"; }
+};
+
+struct Handler
+{
+    virtual ~Handler() = default;
+    virtual std::string name() const = 0;
+};
+
+struct AuthHandler : Handler
+{
+    std::string name() const override { return "auth"; }
+};
+
+struct LogHandler : Handler
+{
+    std::string name() const override { return "log"; }
+};
+
+bool check(const std::string& what, const std::string& actual, const std::string& expected)
+{
+    std::cout << what << ": " << actual << std::endl;
+    return actual == expected;
+}
+
+int main()
+{
+    bool ok = true;
+
+    auto defaults = di::Bindings{}
+        .service<Codec, SlowCodec>();
+
+    auto tuned = di::Bindings{}
+        .service<Codec, FastCodec>();
+
+    auto handlers = di::Bindings{}
+        .service<Handler, AuthHandler>()
+        .service<Handler, LogHandler>();
+
+    {
+        // Later bindings override earlier ones, regardless of how they were created.
+        auto scope = di::Scope{defaults, tuned, handlers};
+
+        di::ServiceRef<Codec> codec;
+        ok &= check("codec", codec->name(), "fast");
+
+        // Within one Bindings, implementations are kept in binding order; ServiceRef uses the last one.
+        di::ServiceRef<Handler> handler;
+        ok &= check("handler", handler->name(), "log");
+
+        std::string names;
+        for (Handler* h : di::ServiceList<Handler>{})
+            names += h->name() + " ";
+
+        ok &= check("handlers", names, "auth log ");
+    }
+
+    {
+        auto scope = di::Scope{tuned, defaults};
+
+        di::ServiceRef<Codec> codec;
+        ok &= check("codec (reversed)", codec->name(), "slow");
+    }
+
+    try
+    {
+        // Binding the same implementation twice is rejected.
+        auto duplicate = di::Bindings{}
+            .service<Codec, FastCodec>()
+            .service<Codec, FastCodec>();
+
+        ok = false;
+    }
+    catch (const std::exception& ex)
+    {
+        std::cout << "error: " << ex.what() << std::endl;
+    }
+
+    return ok ? 0 : 1;
+}